@@ -0,0 +1,283 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nrm.h>
+
+#include "derived.h"
+
+enum derived_op {
+	DERIVED_CONST,
+	DERIVED_VAR,
+	DERIVED_ADD,
+	DERIVED_SUB,
+	DERIVED_MUL,
+	DERIVED_DIV,
+	DERIVED_NEG,
+	DERIVED_DELTA,
+};
+
+struct derived_insn {
+	enum derived_op op;
+	size_t var;
+	double value; /* constant, or previous input of a d() */
+	int primed;
+};
+
+struct nrm_extra_derived_s {
+	struct derived_insn *code;
+	size_t n;
+	size_t size;
+};
+
+/* recursive descent parser, emitting postfix code as it goes */
+struct derived_parser {
+	const char *expr;
+	const char *p;
+	const char *const *vars;
+	size_t nvars;
+	nrm_extra_derived_t *prog;
+	int depth, max_depth;
+};
+
+static int derived_expr(struct derived_parser *ps);
+
+static int derived_emit(struct derived_parser *ps,
+                        enum derived_op op,
+                        size_t var,
+                        double value)
+{
+	nrm_extra_derived_t *prog = ps->prog;
+
+	if (prog->n == prog->size) {
+		size_t size = prog->size ? 2 * prog->size : 16;
+		struct derived_insn *code =
+		        realloc(prog->code, size * sizeof(*code));
+		if (code == NULL)
+			return -NRM_ENOMEM;
+		prog->code = code;
+		prog->size = size;
+	}
+	prog->code[prog->n++] = (struct derived_insn){op, var, value, 0};
+
+	// track the stack depth the program needs
+	if (op == DERIVED_CONST || op == DERIVED_VAR)
+		ps->depth++;
+	else if (op != DERIVED_NEG && op != DERIVED_DELTA)
+		ps->depth--;
+	if (ps->depth > ps->max_depth)
+		ps->max_depth = ps->depth;
+	return 0;
+}
+
+static int derived_error(struct derived_parser *ps, const char *what)
+{
+	nrm_log_error("%s at offset %td in \"%s\"\n", what, ps->p - ps->expr,
+	              ps->expr);
+	return -NRM_EINVAL;
+}
+
+static char derived_peek(struct derived_parser *ps)
+{
+	while (isspace((unsigned char)*ps->p))
+		ps->p++;
+	return *ps->p;
+}
+
+static int derived_primary(struct derived_parser *ps)
+{
+	const char *start;
+	char c = derived_peek(ps);
+	size_t len;
+	int err;
+
+	if (c == '(') {
+		ps->p++;
+		err = derived_expr(ps);
+		if (err)
+			return err;
+		if (derived_peek(ps) != ')')
+			return derived_error(ps, "expected ')'");
+		ps->p++;
+		return 0;
+	}
+	if (isdigit((unsigned char)c) || c == '.') {
+		char *end;
+		double value = strtod(ps->p, &end);
+		ps->p = end;
+		return derived_emit(ps, DERIVED_CONST, 0, value);
+	}
+	if (!isalpha((unsigned char)c) && c != '_')
+		return derived_error(ps, "expected a number or a name");
+
+	start = ps->p;
+	while (isalnum((unsigned char)*ps->p) || *ps->p == '_')
+		ps->p++;
+	len = ps->p - start;
+
+	if (len == 1 && *start == 'd' && derived_peek(ps) == '(') {
+		ps->p++;
+		err = derived_expr(ps);
+		if (err)
+			return err;
+		if (derived_peek(ps) != ')')
+			return derived_error(ps, "expected ')'");
+		ps->p++;
+		return derived_emit(ps, DERIVED_DELTA, 0, 0.0);
+	}
+	for (size_t i = 0; i < ps->nvars; i++)
+		if (strlen(ps->vars[i]) == len && !strncmp(ps->vars[i], start, len))
+			return derived_emit(ps, DERIVED_VAR, i, 0.0);
+	ps->p = start;
+	return derived_error(ps, "unknown variable");
+}
+
+static int derived_unary(struct derived_parser *ps)
+{
+	int err;
+
+	if (derived_peek(ps) == '-') {
+		ps->p++;
+		err = derived_unary(ps);
+		if (err)
+			return err;
+		return derived_emit(ps, DERIVED_NEG, 0, 0.0);
+	}
+	return derived_primary(ps);
+}
+
+static int derived_term(struct derived_parser *ps)
+{
+	int err;
+	char c;
+
+	err = derived_unary(ps);
+	while (!err && ((c = derived_peek(ps)) == '*' || c == '/')) {
+		ps->p++;
+		err = derived_unary(ps);
+		if (!err)
+			err = derived_emit(ps,
+			                   c == '*' ? DERIVED_MUL : DERIVED_DIV,
+			                   0, 0.0);
+	}
+	return err;
+}
+
+static int derived_expr(struct derived_parser *ps)
+{
+	int err;
+	char c;
+
+	err = derived_term(ps);
+	while (!err && ((c = derived_peek(ps)) == '+' || c == '-')) {
+		ps->p++;
+		err = derived_term(ps);
+		if (!err)
+			err = derived_emit(ps,
+			                   c == '+' ? DERIVED_ADD : DERIVED_SUB,
+			                   0, 0.0);
+	}
+	return err;
+}
+
+int nrm_extra_derived_compile(const char *expr,
+                              const char *const *vars,
+                              size_t nvars,
+                              nrm_extra_derived_t **prog)
+{
+	struct derived_parser ps = {expr, expr, vars, nvars, NULL, 0, 0};
+	int err;
+
+	if (expr == NULL || prog == NULL)
+		return -NRM_EINVAL;
+	ps.prog = calloc(1, sizeof(nrm_extra_derived_t));
+	if (ps.prog == NULL)
+		return -NRM_ENOMEM;
+
+	err = derived_expr(&ps);
+	if (!err && derived_peek(&ps) != '\0')
+		err = derived_error(&ps, "unexpected character");
+	if (!err && ps.max_depth > NRM_EXTRA_DERIVED_STACK)
+		err = derived_error(&ps, "expression too deep");
+	if (err) {
+		nrm_extra_derived_destroy(&ps.prog);
+		return err;
+	}
+	*prog = ps.prog;
+	return 0;
+}
+
+double nrm_extra_derived_eval(nrm_extra_derived_t *prog, const double *values)
+{
+	double stack[NRM_EXTRA_DERIVED_STACK];
+	size_t sp = 0;
+
+	for (size_t i = 0; i < prog->n; i++) {
+		struct derived_insn *insn = &prog->code[i];
+		double x;
+
+		switch (insn->op) {
+		case DERIVED_CONST:
+			stack[sp++] = insn->value;
+			break;
+		case DERIVED_VAR:
+			stack[sp++] = values[insn->var];
+			break;
+		case DERIVED_ADD:
+			sp--;
+			stack[sp - 1] += stack[sp];
+			break;
+		case DERIVED_SUB:
+			sp--;
+			stack[sp - 1] -= stack[sp];
+			break;
+		case DERIVED_MUL:
+			sp--;
+			stack[sp - 1] *= stack[sp];
+			break;
+		case DERIVED_DIV:
+			sp--;
+			stack[sp - 1] /= stack[sp];
+			break;
+		case DERIVED_NEG:
+			stack[sp - 1] = -stack[sp - 1];
+			break;
+		case DERIVED_DELTA:
+			x = stack[sp - 1];
+			stack[sp - 1] = insn->primed ? x - insn->value : NAN;
+			insn->value = x;
+			insn->primed = 1;
+			break;
+		}
+	}
+	return stack[0];
+}
+
+int nrm_extra_derived_uses(const nrm_extra_derived_t *prog, size_t var)
+{
+	for (size_t i = 0; i < prog->n; i++)
+		if (prog->code[i].op == DERIVED_VAR && prog->code[i].var == var)
+			return 1;
+	return 0;
+}
+
+void nrm_extra_derived_destroy(nrm_extra_derived_t **prog)
+{
+	if (prog == NULL || *prog == NULL)
+		return;
+	free((*prog)->code);
+	free(*prog);
+	*prog = NULL;
+}
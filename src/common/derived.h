@@ -0,0 +1,39 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#ifndef NRM_EXTRA_DERIVED_H
+#define NRM_EXTRA_DERIVED_H 1
+
+#include <stddef.h>
+
+/* Derived metrics: small arithmetic expressions over the raw readings of a
+ * tool, compiled once at startup into a flat postfix program.
+ *
+ * Expressions use + - * /, parentheses, numbers, the variable names given at
+ * compile time, and d(x), the change of x since the previous evaluation.
+ * For example "d(dram) / (d(pkg) + d(dram))".
+ *
+ * Evaluation allocates nothing and walks the program once. A d() that has not
+ * seen two samples yet evaluates to NaN, and so does anything built on top of
+ * it; callers should skip non-finite values.
+ */
+#define NRM_EXTRA_DERIVED_STACK 32
+
+typedef struct nrm_extra_derived_s nrm_extra_derived_t;
+
+int nrm_extra_derived_compile(const char *expr,
+                              const char *const *vars,
+                              size_t nvars,
+                              nrm_extra_derived_t **prog);
+double nrm_extra_derived_eval(nrm_extra_derived_t *prog, const double *values);
+int nrm_extra_derived_uses(const nrm_extra_derived_t *prog, size_t var);
+void nrm_extra_derived_destroy(nrm_extra_derived_t **prog);
+
+#endif
@@ -11,8 +11,10 @@
 #define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include <nrm.h>
@@ -123,3 +125,240 @@ int nrm_extra_find_scope(nrm_client_t *client, nrm_scope_t **scope, int *added)
 	*added = !newscope;
 	return 0;
 }
+
+int nrm_extra_get_cpu_idx(hwloc_topology_t topology, int cpu)
+{
+	hwloc_obj_t pu;
+	pu = hwloc_get_pu_obj_by_os_index(topology, cpu);
+	return pu->logical_index;
+}
+
+int nrm_extra_create_cpu_scope(nrm_client_t *client,
+                               hwloc_topology_t topology,
+                               const char *pattern,
+                               unsigned int numa_id,
+                               nrm_scope_t **scope,
+                               int *added)
+{
+	char *scope_name;
+	hwloc_obj_t numanode;
+	int err, cpu;
+
+	numanode = hwloc_get_obj_by_type(topology, HWLOC_OBJ_NUMANODE, numa_id);
+	if (numanode == NULL)
+		return -NRM_EINVAL;
+
+	err = nrm_extra_create_name_ssu(pattern, "cpu", numa_id, &scope_name);
+	if (err)
+		return err;
+	nrm_log_debug("Creating new scope: %s\n", scope_name);
+
+	*scope = nrm_scope_create(scope_name);
+	free(scope_name);
+	hwloc_bitmap_foreach_begin(cpu, numanode->cpuset)
+	{
+		nrm_scope_add(*scope, NRM_SCOPE_TYPE_CPU,
+		              nrm_extra_get_cpu_idx(topology, cpu));
+	}
+	hwloc_bitmap_foreach_end();
+	return nrm_extra_find_scope(client, scope, added);
+}
+
+int nrm_extra_create_obj_scope(nrm_client_t *client,
+                               hwloc_topology_t topology,
+                               const char *pattern,
+                               const char *kind,
+                               hwloc_obj_t obj,
+                               nrm_scope_t **scope,
+                               int *added)
+{
+	char *scope_name;
+	int err, cpu;
+
+	err = nrm_extra_create_name_ssu(pattern, kind, obj->logical_index,
+	                                &scope_name);
+	if (err)
+		return err;
+	nrm_log_debug("Creating new scope: %s\n", scope_name);
+
+	*scope = nrm_scope_create(scope_name);
+	free(scope_name);
+	hwloc_bitmap_foreach_begin(cpu, obj->cpuset)
+	{
+		nrm_scope_add(*scope, NRM_SCOPE_TYPE_CPU,
+		              nrm_extra_get_cpu_idx(topology, cpu));
+	}
+	hwloc_bitmap_foreach_end();
+	return nrm_extra_find_scope(client, scope, added);
+}
+
+int nrm_extra_create_numa_scope(nrm_client_t *client,
+                                const char *pattern,
+                                unsigned int numa_id,
+                                nrm_scope_t **scope,
+                                int *added)
+{
+	char *scope_name;
+	int err;
+
+	err = nrm_extra_create_name_ssu(pattern, "numa", numa_id, &scope_name);
+	if (err)
+		return err;
+	nrm_log_debug("Creating new scope: %s\n", scope_name);
+
+	*scope = nrm_scope_create(scope_name);
+	free(scope_name);
+	nrm_scope_add(*scope, NRM_SCOPE_TYPE_NUMA, numa_id);
+	return nrm_extra_find_scope(client, scope, added);
+}
+
+int nrm_extra_create_node_scope(nrm_client_t *client,
+                                hwloc_topology_t topology,
+                                const char *pattern,
+                                nrm_scope_t **scope,
+                                int *added)
+{
+	hwloc_obj_t obj = NULL;
+	char *scope_name;
+	size_t bufsize;
+
+	bufsize = snprintf(NULL, 0, "%s.node", pattern) + 1;
+	scope_name = calloc(1, bufsize);
+	if (!scope_name)
+		return -NRM_ENOMEM;
+	snprintf(scope_name, bufsize, "%s.node", pattern);
+	nrm_log_debug("Creating new scope: %s\n", scope_name);
+
+	*scope = nrm_scope_create(scope_name);
+	free(scope_name);
+	while ((obj = hwloc_get_next_obj_by_type(topology, HWLOC_OBJ_PU,
+	                                         obj)) != NULL)
+		nrm_scope_add(*scope, NRM_SCOPE_TYPE_CPU, obj->logical_index);
+	while ((obj = hwloc_get_next_obj_by_type(topology, HWLOC_OBJ_NUMANODE,
+	                                         obj)) != NULL)
+		nrm_scope_add(*scope, NRM_SCOPE_TYPE_NUMA, obj->logical_index);
+	return nrm_extra_find_scope(client, scope, added);
+}
+
+int nrm_extra_pread_ll(int fd, long long *value)
+{
+	char buf[32], *end;
+	ssize_t n;
+
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -NRM_FAILURE;
+	buf[n] = '\0';
+	errno = 0;
+	*value = strtoll(buf, &end, 10);
+	if (end == buf || errno)
+		return -NRM_EINVAL;
+	return 0;
+}
+
+int nrm_extra_perf_event_open(struct perf_event_attr *attr,
+                              pid_t pid,
+                              int cpu,
+                              int group_fd,
+                              unsigned long flags)
+{
+	return syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+int nrm_extra_deadband_enabled(const nrm_extra_deadband_t *deadband)
+{
+	return deadband->abs > 0.0 || deadband->rel > 0.0;
+}
+
+int nrm_extra_deadband_update(const nrm_extra_deadband_t *deadband,
+                              nrm_extra_deadband_state_t *state,
+                              nrm_time_t now,
+                              double value)
+{
+	double delta;
+	int publish = 0;
+
+	if (!state->published || !nrm_extra_deadband_enabled(deadband))
+		publish = 1;
+	else {
+		delta = fabs(value - state->last);
+		if (deadband->abs > 0.0 && delta > deadband->abs)
+			publish = 1;
+		if (deadband->rel > 0.0 &&
+		    delta > deadband->rel * fabs(state->last))
+			publish = 1;
+		if (deadband->heartbeat > 0 &&
+		    nrm_time_diff(&state->last_time, &now) >=
+		            deadband->heartbeat)
+			publish = 1;
+	}
+
+	if (!publish) {
+		state->suppressed++;
+		return 0;
+	}
+	state->last = value;
+	state->last_time = now;
+	state->published = 1;
+	return 1;
+}
+
+int nrm_extra_forecast_init(nrm_extra_forecast_t *forecast,
+                            double alpha,
+                            double beta,
+                            double gamma,
+                            unsigned int period)
+{
+	if (period > NRM_EXTRA_FORECAST_MAX_PERIOD || alpha <= 0.0 ||
+	    alpha > 1.0 || beta < 0.0 || beta > 1.0 || gamma < 0.0 ||
+	    gamma > 1.0)
+		return -NRM_EINVAL;
+	memset(forecast, 0, sizeof(*forecast));
+	forecast->alpha = alpha;
+	forecast->beta = beta;
+	forecast->gamma = gamma;
+	forecast->period = period;
+	return 0;
+}
+
+void nrm_extra_forecast_update(nrm_extra_forecast_t *forecast, double value)
+{
+	double level, season = 0.0;
+
+	if (forecast->period > 0)
+		season = forecast->season[forecast->phase];
+
+	if (forecast->samples == 0) {
+		forecast->level = value;
+		forecast->trend = 0.0;
+	} else {
+		level = forecast->alpha * (value - season) +
+		        (1.0 - forecast->alpha) *
+		                (forecast->level + forecast->trend);
+		forecast->trend = forecast->beta * (level - forecast->level) +
+		                  (1.0 - forecast->beta) * forecast->trend;
+		forecast->level = level;
+	}
+
+	// seasonal offsets start at zero and are learned over the first
+	// periods, instead of waiting for full periods to initialize them.
+	if (forecast->period > 0) {
+		forecast->season[forecast->phase] =
+		        forecast->gamma * (value - forecast->level) +
+		        (1.0 - forecast->gamma) * season;
+		forecast->phase = (forecast->phase + 1) % forecast->period;
+	}
+	forecast->samples++;
+}
+
+double nrm_extra_forecast_predict(const nrm_extra_forecast_t *forecast,
+                                  unsigned int horizon)
+{
+	double value = forecast->level + horizon * forecast->trend;
+
+	// phase already points at the season of the next sample
+	if (forecast->period > 0 && horizon > 0)
+		value += forecast->season[(forecast->phase + horizon - 1) %
+		                          forecast->period];
+	return value;
+}
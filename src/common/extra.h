@@ -11,6 +11,9 @@
 #ifndef NRM_EXTRA_H
 #define NRM_EXTRA_H 1
 
+#include <hwloc.h>
+#include <sys/types.h>
+
 #include "nrm.h"
 
 int nrm_extra_create_name(const char *pattern, char **name);
@@ -24,4 +27,102 @@ int nrm_extra_find_allowed_scope(nrm_client_t *client,
                                  int *added);
 int nrm_extra_find_scope(nrm_client_t *client, nrm_scope_t **scope, int *added);
 
+/* Scopes shared by all the tools: "<pattern>.cpu.N" holds every PU of NUMA
+ * node N, "<pattern>.numa.N" the node itself. Both go through
+ * nrm_extra_find_scope, so tools reporting on the same resources end up
+ * sharing the same scope in nrmd.
+ */
+int nrm_extra_get_cpu_idx(hwloc_topology_t topology, int cpu);
+int nrm_extra_create_cpu_scope(nrm_client_t *client,
+                               hwloc_topology_t topology,
+                               const char *pattern,
+                               unsigned int numa_id,
+                               nrm_scope_t **scope,
+                               int *added);
+/* "<pattern>.<kind>.N": the PUs of a finer topology object, a package or a
+ * core, N being its logical index.
+ */
+int nrm_extra_create_obj_scope(nrm_client_t *client,
+                               hwloc_topology_t topology,
+                               const char *pattern,
+                               const char *kind,
+                               hwloc_obj_t obj,
+                               nrm_scope_t **scope,
+                               int *added);
+int nrm_extra_create_numa_scope(nrm_client_t *client,
+                                const char *pattern,
+                                unsigned int numa_id,
+                                nrm_scope_t **scope,
+                                int *added);
+/* "<pattern>.node": every PU and NUMA node of the machine */
+int nrm_extra_create_node_scope(nrm_client_t *client,
+                                hwloc_topology_t topology,
+                                const char *pattern,
+                                nrm_scope_t **scope,
+                                int *added);
+
+/* Read an integer from a pre-opened sysfs/procfs file, from offset 0, so that
+ * tools can keep their descriptors open across samples.
+ */
+int nrm_extra_pread_ll(int fd, long long *value);
+
+/* glibc has no wrapper for perf_event_open */
+struct perf_event_attr;
+int nrm_extra_perf_event_open(struct perf_event_attr *attr,
+                              pid_t pid,
+                              int cpu,
+                              int group_fd,
+                              unsigned long flags);
+
+/* Change-driven publishing: a sample is only worth sending upstream if it
+ * moved by more than an absolute or relative threshold since the last one we
+ * published, or if the scope has been silent for longer than the heartbeat.
+ * Both thresholds at zero disable the deadband entirely.
+ */
+typedef struct nrm_extra_deadband_s {
+	double abs; /* absolute threshold, in the unit of the sample */
+	double rel; /* relative threshold, as a fraction of the last sample */
+	int64_t heartbeat; /* maximum silence, in nanoseconds, 0 for none */
+} nrm_extra_deadband_t;
+
+typedef struct nrm_extra_deadband_state_s {
+	double last;
+	nrm_time_t last_time;
+	int published;
+	unsigned long suppressed;
+	unsigned long suppressed_sent; /* last count sent, left to callers */
+} nrm_extra_deadband_state_t;
+
+int nrm_extra_deadband_enabled(const nrm_extra_deadband_t *deadband);
+int nrm_extra_deadband_update(const nrm_extra_deadband_t *deadband,
+                              nrm_extra_deadband_state_t *state,
+                              nrm_time_t now,
+                              double value);
+
+/* Online power forecasting: additive Holt smoothing (level and trend), with
+ * an optional seasonal component of a fixed period, in samples, for
+ * iterative applications. State is fixed-size and updates are O(1).
+ */
+#define NRM_EXTRA_FORECAST_MAX_PERIOD 64
+
+typedef struct nrm_extra_forecast_s {
+	double alpha; /* level smoothing */
+	double beta; /* trend smoothing */
+	double gamma; /* seasonal smoothing */
+	unsigned int period; /* 0 for no seasonality */
+	double level, trend;
+	double season[NRM_EXTRA_FORECAST_MAX_PERIOD];
+	unsigned int phase;
+	unsigned long samples;
+} nrm_extra_forecast_t;
+
+int nrm_extra_forecast_init(nrm_extra_forecast_t *forecast,
+                            double alpha,
+                            double beta,
+                            double gamma,
+                            unsigned int period);
+void nrm_extra_forecast_update(nrm_extra_forecast_t *forecast, double value);
+double nrm_extra_forecast_predict(const nrm_extra_forecast_t *forecast,
+                                  unsigned int horizon);
+
 #endif
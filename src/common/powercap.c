@@ -0,0 +1,170 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "powercap.h"
+
+int nrm_extra_powercap_package_id(const char *zone_name)
+{
+	if (strncmp(zone_name, "package-", strlen("package-")) == 0)
+		return strtol(zone_name + strlen("package-"), NULL, 10);
+	else
+		return -1;
+}
+
+int nrm_extra_powercap_is_dram(const char *subzone_name)
+{
+	return strcmp(subzone_name, "dram") == 0;
+}
+
+static int read_zone_file(const char *root,
+                          const char *zone,
+                          const char *file,
+                          char *buf,
+                          size_t bufsize)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", root, zone, file);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -NRM_EINVAL;
+	n = read(fd, buf, bufsize - 1);
+	close(fd);
+	if (n <= 0)
+		return -NRM_FAILURE;
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int zones_add(nrm_extra_powercap_zone_t **zones,
+                     size_t *nzones,
+                     const char *root,
+                     const char *zone,
+                     int package,
+                     int dram)
+{
+	nrm_extra_powercap_zone_t *tmp;
+	char path[PATH_MAX], buf[32];
+	int fd;
+
+	if (read_zone_file(root, zone, "max_energy_range_uj", buf, sizeof(buf)))
+		return -NRM_EINVAL;
+	snprintf(path, sizeof(path), "%s/%s/energy_uj", root, zone);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -NRM_EINVAL;
+
+	tmp = realloc(*zones, (*nzones + 1) * sizeof(*tmp));
+	if (tmp == NULL) {
+		close(fd);
+		return -NRM_ENOMEM;
+	}
+	*zones = tmp;
+	tmp[*nzones].package = package;
+	tmp[*nzones].dram = dram;
+	tmp[*nzones].fd = fd;
+	tmp[*nzones].max_range = strtoull(buf, NULL, 10);
+	(*nzones)++;
+	return 0;
+}
+
+int nrm_extra_powercap_zones(const char *root,
+                             nrm_extra_powercap_zone_t **zones,
+                             size_t *nzones)
+{
+	struct dirent **entries;
+	char name[32], parent[NAME_MAX + 1];
+	int n, package;
+
+	*zones = NULL;
+	*nzones = 0;
+	n = scandir(root, &entries, NULL, versionsort);
+	if (n < 0)
+		return -NRM_EINVAL;
+
+	// zones are intel-rapl:N, their subzones intel-rapl:N:M
+	for (int i = 0; i < n; i++) {
+		const char *zone = entries[i]->d_name, *sub;
+
+		if (strncmp(zone, "intel-rapl:", strlen("intel-rapl:")) ||
+		    read_zone_file(root, zone, "name", name, sizeof(name)))
+			continue;
+		sub = strchr(zone + strlen("intel-rapl:"), ':');
+		if (sub == NULL) {
+			package = nrm_extra_powercap_package_id(name);
+			if (package != -1)
+				zones_add(zones, nzones, root, zone, package, 0);
+			continue;
+		}
+		if (!nrm_extra_powercap_is_dram(name))
+			continue;
+		snprintf(parent, sizeof(parent), "%.*s", (int)(sub - zone),
+		         zone);
+		if (read_zone_file(root, parent, "name", name, sizeof(name)))
+			continue;
+		package = nrm_extra_powercap_package_id(name);
+		if (package != -1)
+			zones_add(zones, nzones, root, zone, package, 1);
+	}
+
+	for (int i = 0; i < n; i++)
+		free(entries[i]);
+	free(entries);
+	return *nzones > 0 ? 0 : -NRM_EINVAL;
+}
+
+void nrm_extra_powercap_zones_free(nrm_extra_powercap_zone_t *zones,
+                                   size_t nzones)
+{
+	for (size_t i = 0; i < nzones; i++)
+		close(zones[i].fd);
+	free(zones);
+}
+
+int nrm_extra_powercap_read(const nrm_extra_powercap_zone_t *zone,
+                            uint64_t *uj)
+{
+	char buf[32], *end;
+	ssize_t n;
+
+	n = pread(zone->fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -NRM_FAILURE;
+	buf[n] = '\0';
+	errno = 0;
+	*uj = strtoull(buf, &end, 10);
+	if (end == buf || errno)
+		return -NRM_EINVAL;
+	return 0;
+}
+
+uint64_t nrm_extra_powercap_delta(const nrm_extra_powercap_zone_t *zone,
+                                  uint64_t before,
+                                  uint64_t after)
+{
+	if (after >= before)
+		return after - before;
+	return zone->max_range - before + after;
+}
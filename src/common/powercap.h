@@ -0,0 +1,49 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#ifndef NRM_EXTRA_POWERCAP_H
+#define NRM_EXTRA_POWERCAP_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NRM_EXTRA_POWERCAP_ROOT "/sys/class/powercap"
+
+/* Classification of RAPL zones, shared with the PAPI powercap component that
+ * inherits its names from sysfs: top-level zones named "package-N" cover a
+ * package, their "dram" subzone the memory attached to it. Zone ids and
+ * package ids need not match, intel-rapl:2 may well be "package-1".
+ */
+int nrm_extra_powercap_package_id(const char *zone_name);
+int nrm_extra_powercap_is_dram(const char *subzone_name);
+
+typedef struct nrm_extra_powercap_zone_s {
+	int package;
+	int dram; /* 0 for the package itself, 1 for its dram subzone */
+	int fd; /* energy_uj, kept open */
+	uint64_t max_range; /* max_energy_range_uj, where energy_uj wraps */
+} nrm_extra_powercap_zone_t;
+
+/* Open every package and dram zone found under root, skipping the others
+ * (psys, core, uncore).
+ */
+int nrm_extra_powercap_zones(const char *root,
+                             nrm_extra_powercap_zone_t **zones,
+                             size_t *nzones);
+void nrm_extra_powercap_zones_free(nrm_extra_powercap_zone_t *zones,
+                                   size_t nzones);
+int nrm_extra_powercap_read(const nrm_extra_powercap_zone_t *zone,
+                            uint64_t *uj);
+/* microjoules between two readings, accounting for one counter wrap */
+uint64_t nrm_extra_powercap_delta(const nrm_extra_powercap_zone_t *zone,
+                                  uint64_t before,
+                                  uint64_t after);
+
+#endif
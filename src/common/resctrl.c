@@ -0,0 +1,558 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "resctrl.h"
+
+int nrm_extra_resctrl_path(const char *root,
+                           const char *group,
+                           const char *file,
+                           char *buf,
+                           size_t bufsize)
+{
+	int n;
+	if (group == NULL || group[0] == '\0')
+		n = snprintf(buf, bufsize, "%s/%s", root, file);
+	else
+		n = snprintf(buf, bufsize, "%s/%s/%s", root, group, file);
+	if (n < 0 || (size_t)n >= bufsize)
+		return -NRM_EINVAL;
+	return 0;
+}
+
+const char *nrm_extra_resctrl_group_name(const char *group)
+{
+	return group[0] ? group : "default";
+}
+
+static int is_dir(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int groups_add(char ***groups, size_t *ngroups, const char *group)
+{
+	char **tmp;
+	tmp = realloc(*groups, (*ngroups + 1) * sizeof(char *));
+	if (!tmp)
+		return -NRM_ENOMEM;
+	*groups = tmp;
+	tmp[*ngroups] = strdup(group);
+	if (!tmp[*ngroups])
+		return -NRM_ENOMEM;
+	(*ngroups)++;
+	return 0;
+}
+
+/* add a control group if it has monitoring data, then its mon_groups */
+static int
+groups_scan(const char *root, const char *ctrl, char ***groups, size_t *ngroups)
+{
+	char path[PATH_MAX], sub[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+	int err = 0;
+
+	if (nrm_extra_resctrl_path(root, ctrl, "mon_data", path, sizeof(path)))
+		return -NRM_EINVAL;
+	if (is_dir(path)) {
+		err = groups_add(groups, ngroups, ctrl);
+		if (err)
+			return err;
+	}
+
+	if (nrm_extra_resctrl_path(root, ctrl, "mon_groups", path,
+	                           sizeof(path)))
+		return -NRM_EINVAL;
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	while (!err && (d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(sub, sizeof(sub), "%s%smon_groups/%s", ctrl,
+		         ctrl[0] ? "/" : "", d->d_name);
+		if (nrm_extra_resctrl_path(root, sub, "mon_data", path,
+		                           sizeof(path)))
+			continue;
+		if (is_dir(path))
+			err = groups_add(groups, ngroups, sub);
+	}
+	closedir(dir);
+	return err;
+}
+
+int nrm_extra_resctrl_mon_groups(const char *root,
+                                 char ***groups,
+                                 size_t *ngroups)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+	int err;
+
+	*groups = NULL;
+	*ngroups = 0;
+
+	err = groups_scan(root, "", groups, ngroups);
+	if (err)
+		goto error;
+
+	dir = opendir(root);
+	if (dir == NULL) {
+		err = -NRM_EINVAL;
+		goto error;
+	}
+	while (!err && (d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.' || !strcmp(d->d_name, "info") ||
+		    !strcmp(d->d_name, "mon_groups") ||
+		    !strcmp(d->d_name, "mon_data"))
+			continue;
+		if (nrm_extra_resctrl_path(root, d->d_name, "", path,
+		                           sizeof(path)) ||
+		    !is_dir(path))
+			continue;
+		err = groups_scan(root, d->d_name, groups, ngroups);
+	}
+	closedir(dir);
+	if (err)
+		goto error;
+	return 0;
+error:
+	nrm_extra_resctrl_groups_free(*groups, *ngroups);
+	*groups = NULL;
+	*ngroups = 0;
+	return err;
+}
+
+int nrm_extra_resctrl_ctrl_groups(const char *root,
+                                  char ***groups,
+                                  size_t *ngroups)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	DIR *dir;
+	int err;
+
+	*groups = NULL;
+	*ngroups = 0;
+
+	// the default group is always a control group
+	err = groups_add(groups, ngroups, "");
+	if (err)
+		goto error;
+
+	dir = opendir(root);
+	if (dir == NULL) {
+		err = -NRM_EINVAL;
+		goto error;
+	}
+	while (!err && (d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.' || !strcmp(d->d_name, "info"))
+			continue;
+		if (nrm_extra_resctrl_path(root, d->d_name, "schemata", path,
+		                           sizeof(path)) ||
+		    access(path, F_OK))
+			continue;
+		err = groups_add(groups, ngroups, d->d_name);
+	}
+	closedir(dir);
+	if (err)
+		goto error;
+	return 0;
+error:
+	nrm_extra_resctrl_groups_free(*groups, *ngroups);
+	*groups = NULL;
+	*ngroups = 0;
+	return err;
+}
+
+void nrm_extra_resctrl_groups_free(char **groups, size_t ngroups)
+{
+	for (size_t i = 0; i < ngroups; i++)
+		free(groups[i]);
+	free(groups);
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+
+int nrm_extra_resctrl_mon_domains(const char *root,
+                                  const char *group,
+                                  unsigned int **domains,
+                                  size_t *ndomains)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	unsigned int *tmp;
+	DIR *dir;
+
+	*domains = NULL;
+	*ndomains = 0;
+	if (nrm_extra_resctrl_path(root, group, "mon_data", path, sizeof(path)))
+		return -NRM_EINVAL;
+	dir = opendir(path);
+	if (dir == NULL)
+		return -NRM_EINVAL;
+	while ((d = readdir(dir)) != NULL) {
+		if (strncmp(d->d_name, "mon_L3_", strlen("mon_L3_")))
+			continue;
+		tmp = realloc(*domains, (*ndomains + 1) * sizeof(unsigned int));
+		if (!tmp) {
+			closedir(dir);
+			free(*domains);
+			*domains = NULL;
+			*ndomains = 0;
+			return -NRM_ENOMEM;
+		}
+		*domains = tmp;
+		tmp[*ndomains] =
+		        strtoul(d->d_name + strlen("mon_L3_"), NULL, 10);
+		(*ndomains)++;
+	}
+	closedir(dir);
+	qsort(*domains, *ndomains, sizeof(unsigned int), cmp_uint);
+	return 0;
+}
+
+int nrm_extra_resctrl_mon_path(const char *root,
+                               const char *group,
+                               unsigned int domain,
+                               const char *counter,
+                               char *buf,
+                               size_t bufsize)
+{
+	char file[64];
+
+	snprintf(file, sizeof(file), "mon_data/mon_L3_%02u/%s", domain,
+	         counter);
+	return nrm_extra_resctrl_path(root, group, file, buf, bufsize);
+}
+
+int nrm_extra_resctrl_domain_numa(hwloc_topology_t topology,
+                                  unsigned int domain)
+{
+	// L3 domain ids are the cache ids reported by the kernel, which hwloc
+	// exposes as the os_index of the cache object when it knows it.
+	hwloc_obj_t l3 = NULL, obj = NULL, numa = NULL;
+	while ((obj = hwloc_get_next_obj_by_type(topology, HWLOC_OBJ_L3CACHE,
+	                                         obj)) != NULL) {
+		if (obj->os_index == domain ||
+		    (obj->os_index == HWLOC_UNKNOWN_INDEX &&
+		     obj->logical_index == domain)) {
+			l3 = obj;
+			break;
+		}
+	}
+	if (l3 != NULL)
+		while ((numa = hwloc_get_next_obj_by_type(
+		                topology, HWLOC_OBJ_NUMANODE, numa)) != NULL)
+			if (hwloc_bitmap_intersects(numa->cpuset, l3->cpuset))
+				return numa->logical_index;
+	return domain;
+}
+
+int nrm_extra_resctrl_read_u64(int fd, uint64_t *value)
+{
+	char buf[32], *end;
+	ssize_t n;
+
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -NRM_FAILURE;
+	buf[n] = '\0';
+	// the kernel reports "Unavailable" or "Error" instead of a number when
+	// the counter cannot be read.
+	errno = 0;
+	*value = strtoull(buf, &end, 10);
+	if (end == buf || errno)
+		return -NRM_EINVAL;
+	return 0;
+}
+
+int nrm_extra_resctrl_read_file_u64(const char *path, int base, uint64_t *value)
+{
+	char buf[32], *end;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -NRM_EINVAL;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -NRM_FAILURE;
+	buf[n] = '\0';
+	errno = 0;
+	*value = strtoull(buf, &end, base);
+	if (end == buf || errno)
+		return -NRM_EINVAL;
+	return 0;
+}
+
+int nrm_extra_resctrl_read_schemata(const char *root,
+                                    const char *group,
+                                    const char *resource,
+                                    int base,
+                                    unsigned int *domains,
+                                    uint64_t *values,
+                                    size_t max,
+                                    size_t *n)
+{
+	char path[PATH_MAX], line[4096], *p, *end;
+	size_t len = strlen(resource);
+	FILE *f;
+
+	*n = 0;
+	if (nrm_extra_resctrl_path(root, group, "schemata", path, sizeof(path)))
+		return -NRM_EINVAL;
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -NRM_EINVAL;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		// lines look like "    L3:0=7ff;1=7ff"
+		p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (strncmp(p, resource, len) || p[len] != ':')
+			continue;
+		p += len + 1;
+		while (*n < max && *p != '\0' && *p != '\n') {
+			domains[*n] = strtoul(p, &end, 10);
+			if (end == p || *end != '=')
+				break;
+			p = end + 1;
+			values[*n] = strtoull(p, &end, base);
+			if (end == p)
+				break;
+			(*n)++;
+			p = end;
+			if (*p == ';')
+				p++;
+		}
+		break;
+	}
+	fclose(f);
+	return 0;
+}
+
+static int
+read_info(const char *root, const char *file, int base, uint64_t *value)
+{
+	char path[PATH_MAX];
+	if (nrm_extra_resctrl_path(root, "info", file, path, sizeof(path)))
+		return -NRM_EINVAL;
+	return nrm_extra_resctrl_read_file_u64(path, base, value);
+}
+
+/* Whether root is a resctrl mount using bandwidth units for MB: mounted
+ * with mba_MBps, or on AMD. Fake trees are not mounts, and say no.
+ */
+static int mb_in_units(const char *root)
+{
+	char line[4096], mnt[PATH_MAX], type[64], opts[1024];
+	int mounted = 0, mbps = 0, amd = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/mounts", "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL)
+		if (sscanf(line, "%*s %4095s %63s %1023s", mnt, type,
+		           opts) == 3 &&
+		    !strcmp(type, "resctrl") && !strcmp(mnt, root)) {
+			mounted = 1;
+			mbps = strstr(opts, "mba_MBps") != NULL;
+		}
+	fclose(f);
+	if (!mounted)
+		return 0;
+
+	f = fopen("/proc/cpuinfo", "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL)
+			if (!strncmp(line, "vendor_id", strlen("vendor_id"))) {
+				amd = strstr(line, "AuthenticAMD") != NULL ||
+				      strstr(line, "HygonGenuine") != NULL;
+				break;
+			}
+		fclose(f);
+	}
+	return mbps || amd;
+}
+
+int nrm_extra_resctrl_alloc_info(const char *root,
+                                 nrm_extra_resctrl_alloc_t *hw)
+{
+	unsigned int domains[256];
+	uint64_t values[256];
+	size_t n;
+
+	memset(hw, 0, sizeof(*hw));
+	hw->available[NRM_EXTRA_RESCTRL_L3] =
+	        !read_info(root, "L3/cbm_mask", 16, &hw->cbm_mask) &&
+	        !read_info(root, "L3/min_cbm_bits", 10, &hw->min_cbm_bits) &&
+	        hw->cbm_mask != 0;
+	if (read_info(root, "L3/sparse_masks", 10, &hw->sparse_masks))
+		hw->sparse_masks = 0;
+	hw->available[NRM_EXTRA_RESCTRL_MB] =
+	        !read_info(root, "MB/min_bandwidth", 10, &hw->min_bandwidth) &&
+	        !read_info(root, "MB/bandwidth_gran", 10,
+	                   &hw->bandwidth_gran) &&
+	        hw->bandwidth_gran > 0;
+
+	// a percentage never goes above 100, in the default group included
+	if (hw->available[NRM_EXTRA_RESCTRL_MB]) {
+		int units = mb_in_units(root);
+
+		nrm_extra_resctrl_read_schemata(root, "", "MB", 10, domains,
+		                                values, 256, &n);
+		for (size_t d = 0; d < n; d++)
+			units |= values[d] > 100;
+		if (units) {
+			nrm_log_info("MB values are not percentages, skipping MB\n");
+			hw->available[NRM_EXTRA_RESCTRL_MB] = 0;
+		}
+	}
+
+	if (!hw->available[NRM_EXTRA_RESCTRL_L3] &&
+	    !hw->available[NRM_EXTRA_RESCTRL_MB])
+		return -NRM_EINVAL;
+	return 0;
+}
+
+int nrm_extra_resctrl_cbm_valid(const nrm_extra_resctrl_alloc_t *hw,
+                                uint64_t mask)
+{
+	if (mask == 0 || (mask & ~hw->cbm_mask))
+		return 0;
+	if ((uint64_t)__builtin_popcountll(mask) < hw->min_cbm_bits)
+		return 0;
+	if (!hw->sparse_masks) {
+		// contiguous: once shifted down, the mask is all ones
+		mask >>= __builtin_ctzll(mask);
+		if (mask & (mask + 1))
+			return 0;
+	}
+	return 1;
+}
+
+/* "L3:0=ff;1=ff\n", in the base the kernel expects for the resource */
+static int schema_line(const nrm_extra_resctrl_schema_t *schema,
+                       uint64_t value,
+                       char *buf,
+                       size_t bufsize)
+{
+	int l3 = schema->resource == NRM_EXTRA_RESCTRL_L3;
+	size_t n;
+
+	n = snprintf(buf, bufsize, "%s:", l3 ? "L3" : "MB");
+	for (size_t d = 0; d < schema->ndomains && n < bufsize; d++)
+		n += snprintf(buf + n, bufsize - n,
+		              l3 ? "%s%u=%" PRIx64 : "%s%u=%" PRIu64,
+		              d ? ";" : "", schema->domains[d], value);
+	if (n < bufsize)
+		n += snprintf(buf + n, bufsize - n, "\n");
+	return n < bufsize ? (int)n : -NRM_EINVAL;
+}
+
+int nrm_extra_resctrl_schema_write(const nrm_extra_resctrl_alloc_t *hw,
+                                   nrm_extra_resctrl_schema_t *schema,
+                                   uint64_t value)
+{
+	char buf[1024];
+	int n;
+
+	if (schema->resource == NRM_EXTRA_RESCTRL_L3) {
+		if (!nrm_extra_resctrl_cbm_valid(hw, value)) {
+			nrm_log_error(
+			        "invalid L3 mask %" PRIx64 " (cbm_mask %" PRIx64
+			        ", min_cbm_bits %" PRIu64 ")\n",
+			        value, hw->cbm_mask, hw->min_cbm_bits);
+			return -NRM_EINVAL;
+		}
+	} else {
+		if (value < hw->min_bandwidth || value > 100) {
+			nrm_log_error("invalid MB percentage %" PRIu64
+			              " (min_bandwidth %" PRIu64 ")\n",
+			              value, hw->min_bandwidth);
+			return -NRM_EINVAL;
+		}
+		// the kernel rounds up to the granularity, do it here so that
+		// coalescing sees the value actually applied
+		value = (value + hw->bandwidth_gran - 1) / hw->bandwidth_gran *
+		        hw->bandwidth_gran;
+		if (value > 100)
+			value = 100;
+	}
+
+	if (value == schema->current) {
+		nrm_log_debug("already at %" PRIu64 ", skipping\n", value);
+		return 0;
+	}
+
+	n = schema_line(schema, value, buf, sizeof(buf));
+	if (n < 0)
+		return n;
+	// the kernel parses each write on its own, from offset 0
+	nrm_log_debug("writing %s", buf);
+	if (pwrite(schema->fd, buf, n, 0) != n) {
+		nrm_log_error("schemata write failed: %s\n", strerror(errno));
+		return -NRM_FAILURE;
+	}
+	schema->current = value;
+	return 0;
+}
+
+int nrm_extra_resctrl_set_cpus(const char *root,
+                               const char *group,
+                               const char *cpus)
+{
+	char path[PATH_MAX], buf[4096];
+	int fd, n, err = 0;
+
+	if (nrm_extra_resctrl_path(root, group, "cpus_list", path,
+	                           sizeof(path)))
+		return -NRM_EINVAL;
+	n = snprintf(buf, sizeof(buf), "%s\n", cpus);
+	if (n < 0 || (size_t)n >= sizeof(buf))
+		return -NRM_EINVAL;
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		nrm_log_error("cannot open %s: %s\n", path, strerror(errno));
+		return -NRM_FAILURE;
+	}
+	if (pwrite(fd, buf, n, 0) != n) {
+		nrm_log_error("cannot set cpus of %s: %s\n", path,
+		              strerror(errno));
+		err = -NRM_FAILURE;
+	}
+	close(fd);
+	return err;
+}
@@ -0,0 +1,136 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#ifndef NRM_EXTRA_RESCTRL_H
+#define NRM_EXTRA_RESCTRL_H 1
+
+#include <hwloc.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NRM_EXTRA_RESCTRL_ROOT "/sys/fs/resctrl"
+
+/* Helpers around the resctrl filesystem (Intel RDT, AMD QoS). Every function
+ * takes the root of the tree as argument, so that tools can be pointed at a
+ * fake hierarchy instead of the kernel one.
+ *
+ * Groups are named by their path relative to the root: "" is the default
+ * group, "foo" a control group, "mon_groups/bar" or "foo/mon_groups/bar" a
+ * monitoring group.
+ */
+int nrm_extra_resctrl_path(const char *root,
+                           const char *group,
+                           const char *file,
+                           char *buf,
+                           size_t bufsize);
+const char *nrm_extra_resctrl_group_name(const char *group);
+
+int nrm_extra_resctrl_mon_groups(const char *root,
+                                 char ***groups,
+                                 size_t *ngroups);
+void nrm_extra_resctrl_groups_free(char **groups, size_t ngroups);
+
+int nrm_extra_resctrl_ctrl_groups(const char *root,
+                                  char ***groups,
+                                  size_t *ngroups);
+
+/* L3 domains a group monitors, from its mon_data/mon_L3_XX directories,
+ * sorted, and the path of a counter file of one of them.
+ */
+int nrm_extra_resctrl_mon_domains(const char *root,
+                                  const char *group,
+                                  unsigned int **domains,
+                                  size_t *ndomains);
+int nrm_extra_resctrl_mon_path(const char *root,
+                               const char *group,
+                               unsigned int domain,
+                               const char *counter,
+                               char *buf,
+                               size_t bufsize);
+
+/* NUMA node of an L3 domain, the index of the nrm.*.numa.N scopes. Both
+ * resctrl tools name things by it. Falls back to the domain id itself when
+ * hwloc does not know the cache.
+ */
+int nrm_extra_resctrl_domain_numa(hwloc_topology_t topology,
+                                  unsigned int domain);
+
+int nrm_extra_resctrl_read_u64(int fd, uint64_t *value);
+int nrm_extra_resctrl_read_file_u64(const char *path,
+                                    int base,
+                                    uint64_t *value);
+
+/* Parse the line of a group schemata file for the given resource ("L3",
+ * "MB"), filling at most max (domain, value) pairs. L3 masks are in hex, MB
+ * values in decimal, hence the base argument.
+ */
+int nrm_extra_resctrl_read_schemata(const char *root,
+                                    const char *group,
+                                    const char *resource,
+                                    int base,
+                                    unsigned int *domains,
+                                    uint64_t *values,
+                                    size_t max,
+                                    size_t *n);
+
+/* Allocation constraints of the hardware, from the info directory. MB is
+ * only handled as a percentage (Intel MBA): it is left unavailable when
+ * values are bandwidth units instead, as on AMD or with mba_MBps.
+ */
+enum {
+	NRM_EXTRA_RESCTRL_L3,
+	NRM_EXTRA_RESCTRL_MB,
+	NRM_EXTRA_RESCTRL_MAX,
+};
+
+typedef struct nrm_extra_resctrl_alloc_s {
+	int available[NRM_EXTRA_RESCTRL_MAX];
+	uint64_t cbm_mask;
+	uint64_t min_cbm_bits;
+	uint64_t sparse_masks;
+	uint64_t min_bandwidth;
+	uint64_t bandwidth_gran;
+} nrm_extra_resctrl_alloc_t;
+
+int nrm_extra_resctrl_alloc_info(const char *root,
+                                 nrm_extra_resctrl_alloc_t *hw);
+int nrm_extra_resctrl_cbm_valid(const nrm_extra_resctrl_alloc_t *hw,
+                                uint64_t mask);
+
+/* Entries of a group schemata for one resource, set together to the same
+ * value: the L3 domains of a NUMA node. fd is the schemata file of the
+ * group, open for writing. current is NRM_EXTRA_RESCTRL_UNKNOWN when the
+ * domains do not agree.
+ */
+#define NRM_EXTRA_RESCTRL_UNKNOWN UINT64_MAX
+
+typedef struct nrm_extra_resctrl_schema_s {
+	int fd;
+	int resource;
+	unsigned int *domains;
+	size_t ndomains;
+	uint64_t current;
+} nrm_extra_resctrl_schema_t;
+
+/* Validate value against the hardware constraints and write it to every
+ * domain, unless they already hold it. MB values are rounded up to the
+ * granularity, as the kernel does. Returns -NRM_EINVAL for an invalid
+ * value, -NRM_FAILURE when the kernel rejects the write.
+ */
+int nrm_extra_resctrl_schema_write(const nrm_extra_resctrl_alloc_t *hw,
+                                   nrm_extra_resctrl_schema_t *schema,
+                                   uint64_t value);
+
+/* Tie a control group to cpus, given as a cpu list ("0-7,16-23") */
+int nrm_extra_resctrl_set_cpus(const char *root,
+                               const char *group,
+                               const char *cpus);
+
+#endif
@@ -0,0 +1,368 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmcpustat.c
+ *
+ * Description: Implements middleware between /proc/stat and the NRM
+ *               downstream interface. Reports, per CPU scope, the fraction
+ *               of time the CPUs spent busy, idle, waiting on IO or stolen
+ *               by the hypervisor since the previous sample.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+char *usage =
+        "usage: nrm-cpustat [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -h, --help              Displays this help message\n";
+
+/* Columns of the cpuN lines of /proc/stat. guest and guest_nice are already
+ * accounted in user and nice, so we stop at steal.
+ */
+enum {
+	STAT_USER,
+	STAT_NICE,
+	STAT_SYSTEM,
+	STAT_IDLE,
+	STAT_IOWAIT,
+	STAT_IRQ,
+	STAT_SOFTIRQ,
+	STAT_STEAL,
+	STAT_MAX,
+};
+
+enum {
+	CPUSTAT_BUSY,
+	CPUSTAT_IDLE,
+	CPUSTAT_IOWAIT,
+	CPUSTAT_STEAL,
+	CPUSTAT_MAX,
+};
+
+static const char *cpustat_names[CPUSTAT_MAX] = {
+        "busy",
+        "idle",
+        "iowait",
+        "steal",
+};
+
+struct cpustat_cpu {
+	ssize_t scope; /* -1 if the cpu is not part of any scope */
+	uint64_t last[STAT_MAX];
+	int valid;
+};
+
+struct cpustat_scope {
+	nrm_scope_t *scope;
+	int added;
+	uint64_t total;
+	uint64_t sum[CPUSTAT_MAX];
+};
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+static const char *scan_u64(const char *p, const char *end, uint64_t *value)
+{
+	uint64_t v = 0;
+
+	while (p < end && *p == ' ')
+		p++;
+	if (p == end || *p < '0' || *p > '9')
+		return NULL;
+	while (p < end && *p >= '0' && *p <= '9')
+		v = v * 10 + (*p++ - '0');
+	*value = v;
+	return p;
+}
+
+/* Walk the per-cpu lines at the top of /proc/stat, accumulating the deltas
+ * since the previous call into the scopes. Everything happens in place: the
+ * buffer is only read, and the cpus array was sized for the whole machine at
+ * startup.
+ */
+static void parse_stat(const char *buf,
+                       size_t len,
+                       struct cpustat_cpu *cpus,
+                       size_t n_cpus,
+                       struct cpustat_scope *scopes)
+{
+	const char *p = buf, *end = buf + len;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		uint64_t stat[STAT_MAX] = {0}, idx, total, d[STAT_MAX];
+		struct cpustat_cpu *c;
+		struct cpustat_scope *s;
+		int k;
+
+		if (eol == NULL)
+			eol = end;
+		// cpu lines come first, the aggregate "cpu " line included
+		if (eol - p < 4 || memcmp(p, "cpu", 3))
+			break;
+		if (p[3] < '0' || p[3] > '9')
+			goto next;
+		p = scan_u64(p + 3, eol, &idx);
+		if (p == NULL || idx >= n_cpus)
+			goto next;
+		for (k = 0; k < STAT_MAX && p != NULL; k++)
+			p = scan_u64(p, eol, &stat[k]);
+		// older kernels have fewer columns, the missing ones stay 0
+		c = &cpus[idx];
+		if (c->scope < 0)
+			goto next;
+		if (c->valid) {
+			total = 0;
+			for (k = 0; k < STAT_MAX; k++) {
+				// counters can go backwards across hotplug
+				d[k] = stat[k] >= c->last[k]
+				               ? stat[k] - c->last[k]
+				               : 0;
+				total += d[k];
+			}
+			s = &scopes[c->scope];
+			s->total += total;
+			s->sum[CPUSTAT_IDLE] += d[STAT_IDLE];
+			s->sum[CPUSTAT_IOWAIT] += d[STAT_IOWAIT];
+			s->sum[CPUSTAT_STEAL] += d[STAT_STEAL];
+			s->sum[CPUSTAT_BUSY] += total - d[STAT_IDLE] -
+			                        d[STAT_IOWAIT] - d[STAT_STEAL];
+		}
+		memcpy(c->last, stat, sizeof(stat));
+		c->valid = 1;
+next:
+		p = eol + 1;
+	}
+}
+
+static ssize_t read_stat(int fd, char **buf, size_t *size)
+{
+	ssize_t n;
+
+	// only grows if the machine gained cpus since startup
+	while ((n = pread(fd, *buf, *size, 0)) == (ssize_t)*size) {
+		char *tmp = realloc(*buf, *size * 2);
+		if (tmp == NULL)
+			return -1;
+		*buf = tmp;
+		*size *= 2;
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	double freq = 1;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"frequency", required_argument, 0, 'f'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhf:", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.cpustat") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	hwloc_topology_t topology;
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	// one CPU scope per NUMA node, as nrm-power-papi does
+	size_t n_scopes, n_cpus;
+	struct cpustat_scope *scopes;
+	struct cpustat_cpu *cpus;
+
+	n_scopes = hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_NUMANODE);
+	n_cpus = hwloc_bitmap_last(hwloc_topology_get_complete_cpuset(topology)) +
+	         1;
+	scopes = calloc(n_scopes, sizeof(struct cpustat_scope));
+	cpus = calloc(n_cpus, sizeof(struct cpustat_cpu));
+	assert(scopes != NULL && cpus != NULL);
+	for (size_t i = 0; i < n_cpus; i++)
+		cpus[i].scope = -1;
+
+	for (size_t s = 0; s < n_scopes; s++) {
+		hwloc_obj_t numanode;
+		int cpu;
+
+		err = nrm_extra_create_cpu_scope(client, topology, "nrm.cpustat",
+		                                 s, &scopes[s].scope,
+		                                 &scopes[s].added);
+		assert(err == 0);
+
+		numanode = hwloc_get_obj_by_type(topology, HWLOC_OBJ_NUMANODE, s);
+		hwloc_bitmap_foreach_begin(cpu, numanode->cpuset)
+		{
+			if ((size_t)cpu < n_cpus)
+				cpus[cpu].scope = s;
+		}
+		hwloc_bitmap_foreach_end();
+	}
+
+	nrm_sensor_t *sensors[CPUSTAT_MAX];
+	char name[64];
+	for (int k = 0; k < CPUSTAT_MAX; k++) {
+		snprintf(name, sizeof(name), "nrm.sensor.cpustat.%s",
+		         cpustat_names[k]);
+		sensors[k] = nrm_sensor_create(name);
+		assert(nrm_client_add_sensor(client, sensors[k]) == 0);
+	}
+
+	// a cpu line is at most 11 20-digit columns, the rest of the file is
+	// a handful of lines.
+	size_t bufsize = 256 * (n_cpus + 1) + 4096;
+	char *buf = malloc(bufsize);
+	int stat_fd = open("/proc/stat", O_RDONLY);
+	ssize_t len;
+	assert(buf != NULL && stat_fd != -1);
+
+	len = read_stat(stat_fd, &buf, &bufsize);
+	assert(len > 0);
+	parse_stat(buf, len, cpus, n_cpus, scopes);
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_time_t current_time;
+
+	stop = 0;
+	double sleeptime = 1 / freq;
+
+	while (!stop) {
+		/* sleep for a frequency */
+		struct timespec req, rem;
+		req.tv_sec = sleeptime;
+		req.tv_nsec = (sleeptime - req.tv_sec) * 1e9;
+
+		err = nanosleep(&req, &rem);
+		if (err == -1 && errno == EINTR)
+			continue;
+
+		nrm_time_gettime(&current_time);
+
+		len = read_stat(stat_fd, &buf, &bufsize);
+		if (len <= 0) {
+			nrm_log_error("failed to read /proc/stat\n");
+			break;
+		}
+		for (size_t s = 0; s < n_scopes; s++) {
+			scopes[s].total = 0;
+			memset(scopes[s].sum, 0, sizeof(scopes[s].sum));
+		}
+		parse_stat(buf, len, cpus, n_cpus, scopes);
+
+		for (size_t s = 0; s < n_scopes && !stop; s++) {
+			// less than a jiffy elapsed on this scope
+			if (scopes[s].total == 0)
+				continue;
+			for (int k = 0; k < CPUSTAT_MAX; k++) {
+				double value = (double)scopes[s].sum[k] /
+				               scopes[s].total;
+
+				nrm_log_debug("scope %zu %-6s %f\n", s,
+				              cpustat_names[k], value);
+				if (nrm_client_send_event(client, current_time,
+				                          sensors[k],
+				                          scopes[s].scope, value)) {
+					stop = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	close(stat_fd);
+	for (size_t s = 0; s < n_scopes; s++) {
+		if (scopes[s].added)
+			nrm_client_remove_scope(client, scopes[s].scope);
+		nrm_scope_destroy(scopes[s].scope);
+	}
+	nrm_log_debug("NRM scopes deleted.\n");
+
+	for (int k = 0; k < CPUSTAT_MAX; k++)
+		nrm_sensor_destroy(&sensors[k]);
+	nrm_client_destroy(&client);
+
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+	free(buf);
+	free(cpus);
+	free(scopes);
+
+	exit(EXIT_SUCCESS);
+}
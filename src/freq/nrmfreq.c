@@ -0,0 +1,453 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmfreq.c
+ *
+ * Description: Implements middleware between CPU frequency counters and the
+ *               NRM downstream interface. Reports the frequency requested
+ *               through cpufreq and the effective frequency and cycle count
+ *               derived from APERF/MPERF, read from perf or, failing that,
+ *               from the msr driver. Values are averaged per NUMA node, as
+ *               for the power scopes, or per package, core or PU.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+char *usage =
+        "usage: nrm-freq [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -l, --level <level>     Report per numa (default, scopes nrm.freq.cpu.N), package, core or pu\n"
+        "            -h, --help              Displays this help message\n";
+
+#define MSR_IA32_MPERF 0xe7
+#define MSR_IA32_APERF 0xe8
+
+enum {
+	FREQ_SCALING,
+	FREQ_EFFECTIVE,
+	FREQ_CYCLES,
+	FREQ_MAX,
+};
+
+static const char *freq_names[FREQ_MAX] = {
+        "scaling",
+        "effective",
+        "cycles",
+};
+
+enum {
+	COUNTERS_NONE,
+	COUNTERS_MSR,
+	COUNTERS_PERF,
+};
+
+struct freq_cpu {
+	int os_index;
+	size_t scope;
+	int cur_fd; /* cpufreq/scaling_cur_freq, in kHz */
+	int counters_fd; /* /dev/cpu/N/msr, or perf group leader */
+	int ref_fd; /* perf group member, closed with the leader */
+	double base; /* MHz, the rate at which MPERF ticks */
+	uint64_t aperf, mperf;
+	int valid;
+};
+
+struct freq_scope {
+	nrm_scope_t *scope;
+	int added;
+	double sum[FREQ_MAX];
+	size_t count[FREQ_MAX];
+	double cycles; /* cumulative */
+};
+
+static int counters = COUNTERS_NONE;
+
+/* aggregation levels, and the kind of scope each one publishes on */
+static const struct {
+	const char *name;
+	hwloc_obj_type_t type;
+	const char *kind;
+} levels[] = {
+        {"numa", HWLOC_OBJ_NUMANODE, "cpu"},
+        {"package", HWLOC_OBJ_PACKAGE, "package"},
+        {"core", HWLOC_OBJ_CORE, "core"},
+        {"pu", HWLOC_OBJ_PU, "pu"},
+};
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+static int open_cpu_file(int cpu, const char *file)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/%s",
+	         cpu, file);
+	return open(path, O_RDONLY);
+}
+
+static double read_base_frequency(int cpu)
+{
+	long long khz;
+	int fd;
+
+	// MPERF ticks at the base (TSC) frequency. cpuinfo_max_freq includes
+	// turbo on some drivers, so only use it if base_frequency is missing.
+	fd = open_cpu_file(cpu, "base_frequency");
+	if (fd == -1)
+		fd = open_cpu_file(cpu, "cpuinfo_max_freq");
+	if (fd == -1)
+		return 0.0;
+	if (nrm_extra_pread_ll(fd, &khz))
+		khz = 0;
+	close(fd);
+	return khz / 1e3;
+}
+
+static int open_msr(struct freq_cpu *c)
+{
+	char path[PATH_MAX];
+	uint64_t v;
+
+	snprintf(path, sizeof(path), "/dev/cpu/%d/msr", c->os_index);
+	c->counters_fd = open(path, O_RDONLY);
+	if (c->counters_fd == -1)
+		return -NRM_EINVAL;
+	if (pread(c->counters_fd, &v, sizeof(v), MSR_IA32_APERF) != sizeof(v)) {
+		close(c->counters_fd);
+		c->counters_fd = -1;
+		return -NRM_EINVAL;
+	}
+	return 0;
+}
+
+static int open_perf(struct freq_cpu *c)
+{
+	struct perf_event_attr attr;
+
+	// cycles and ref-cycles count while unhalted, like APERF and MPERF.
+	// Grouped, so one read returns both.
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.read_format = PERF_FORMAT_GROUP;
+	c->counters_fd =
+	        nrm_extra_perf_event_open(&attr, -1, c->os_index, -1, 0);
+	if (c->counters_fd == -1)
+		return -NRM_EINVAL;
+
+	attr.config = PERF_COUNT_HW_REF_CPU_CYCLES;
+	c->ref_fd = nrm_extra_perf_event_open(&attr, -1, c->os_index,
+	                                      c->counters_fd, 0);
+	if (c->ref_fd == -1) {
+		close(c->counters_fd);
+		c->counters_fd = -1;
+		return -NRM_EINVAL;
+	}
+	return 0;
+}
+
+static int read_counters(struct freq_cpu *c, uint64_t *aperf, uint64_t *mperf)
+{
+	if (counters == COUNTERS_MSR) {
+		if (pread(c->counters_fd, aperf, sizeof(*aperf),
+		          MSR_IA32_APERF) != sizeof(*aperf) ||
+		    pread(c->counters_fd, mperf, sizeof(*mperf),
+		          MSR_IA32_MPERF) != sizeof(*mperf))
+			return -NRM_FAILURE;
+	} else {
+		uint64_t buf[3]; /* nr, cycles, ref-cycles */
+		if (read(c->counters_fd, buf, sizeof(buf)) != sizeof(buf) ||
+		    buf[0] != 2)
+			return -NRM_FAILURE;
+		*aperf = buf[1];
+		*mperf = buf[2];
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	double freq = 1;
+	size_t level = 0;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"frequency", required_argument, 0, 'f'},
+		        {"level", required_argument, 0, 'l'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhf:l:", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 'l':
+			for (level = 0;
+			     level < sizeof(levels) / sizeof(levels[0]) &&
+			     strcmp(optarg, levels[level].name);
+			     level++)
+				;
+			if (level == sizeof(levels) / sizeof(levels[0])) {
+				fprintf(stderr, "Unknown level: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.freq") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	hwloc_topology_t topology;
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	// by default one CPU scope per NUMA node, as nrm-power-papi does
+	size_t n_scopes, n_cpus = 0;
+	struct freq_scope *scopes;
+	struct freq_cpu *cpus;
+
+	n_scopes = hwloc_get_nbobjs_by_type(topology, levels[level].type);
+	scopes = calloc(n_scopes, sizeof(struct freq_scope));
+	cpus = calloc(hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_PU),
+	              sizeof(struct freq_cpu));
+	assert(scopes != NULL && cpus != NULL);
+
+	for (size_t s = 0; s < n_scopes; s++) {
+		hwloc_obj_t obj;
+		int cpu;
+
+		obj = hwloc_get_obj_by_type(topology, levels[level].type, s);
+		if (levels[level].type == HWLOC_OBJ_NUMANODE)
+			err = nrm_extra_create_cpu_scope(client, topology,
+			                                 "nrm.freq", s,
+			                                 &scopes[s].scope,
+			                                 &scopes[s].added);
+		else
+			err = nrm_extra_create_obj_scope(
+			        client, topology, "nrm.freq", levels[level].kind,
+			        obj, &scopes[s].scope, &scopes[s].added);
+		assert(err == 0);
+
+		hwloc_bitmap_foreach_begin(cpu, obj->cpuset)
+		{
+			struct freq_cpu *c = &cpus[n_cpus++];
+			c->os_index = cpu;
+			c->scope = s;
+			c->cur_fd = open_cpu_file(cpu, "scaling_cur_freq");
+			c->counters_fd = -1;
+			c->ref_fd = -1;
+			c->base = read_base_frequency(cpu);
+		}
+		hwloc_bitmap_foreach_end();
+	}
+
+	// Reading a remote cpu costs a cross-cpu call (IPI) per read: one for
+	// the perf group, two for the APERF and MPERF msrs. Prefer perf, pick
+	// the source that works on the first cpu, then stick to it.
+	for (size_t i = 0; i < n_cpus; i++) {
+		struct freq_cpu *c = &cpus[i];
+		if (i > 0 && counters == COUNTERS_NONE)
+			break;
+		if (counters != COUNTERS_MSR && !open_perf(c))
+			counters = COUNTERS_PERF;
+		else if (counters != COUNTERS_PERF && !open_msr(c))
+			counters = COUNTERS_MSR;
+	}
+	nrm_log_debug("%zu cpus over %zu scopes, counters from %s\n", n_cpus,
+	              n_scopes,
+	              counters == COUNTERS_MSR    ? "msr"
+	              : counters == COUNTERS_PERF ? "perf"
+	                                          : "nowhere");
+
+	nrm_sensor_t *sensors[FREQ_MAX] = {NULL};
+	char name[64];
+	for (int k = 0; k < FREQ_MAX; k++) {
+		if (k != FREQ_SCALING && counters == COUNTERS_NONE)
+			continue;
+		snprintf(name, sizeof(name), "nrm.sensor.freq.%s",
+		         freq_names[k]);
+		sensors[k] = nrm_sensor_create(name);
+		assert(nrm_client_add_sensor(client, sensors[k]) == 0);
+	}
+
+	for (size_t i = 0; i < n_cpus; i++)
+		if (cpus[i].counters_fd != -1)
+			cpus[i].valid = !read_counters(&cpus[i], &cpus[i].aperf,
+			                               &cpus[i].mperf);
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_time_t current_time;
+
+	stop = 0;
+	double sleeptime = 1 / freq;
+
+	while (!stop) {
+		/* sleep for a frequency */
+		struct timespec req, rem;
+		req.tv_sec = sleeptime;
+		req.tv_nsec = (sleeptime - req.tv_sec) * 1e9;
+
+		err = nanosleep(&req, &rem);
+		if (err == -1 && errno == EINTR)
+			continue;
+
+		nrm_time_gettime(&current_time);
+
+		for (size_t s = 0; s < n_scopes; s++) {
+			memset(scopes[s].sum, 0, sizeof(scopes[s].sum));
+			memset(scopes[s].count, 0, sizeof(scopes[s].count));
+		}
+
+		for (size_t i = 0; i < n_cpus; i++) {
+			struct freq_cpu *c = &cpus[i];
+			struct freq_scope *s = &scopes[c->scope];
+			uint64_t aperf, mperf;
+			long long khz;
+
+			if (c->cur_fd != -1 && !nrm_extra_pread_ll(c->cur_fd, &khz)) {
+				s->sum[FREQ_SCALING] += khz / 1e3;
+				s->count[FREQ_SCALING]++;
+			}
+
+			if (c->counters_fd == -1 ||
+			    read_counters(c, &aperf, &mperf)) {
+				c->valid = 0;
+				continue;
+			}
+			if (c->valid && aperf >= c->aperf && mperf > c->mperf) {
+				s->cycles += aperf - c->aperf;
+				s->count[FREQ_CYCLES]++;
+				if (c->base > 0.0) {
+					s->sum[FREQ_EFFECTIVE] +=
+					        c->base * (aperf - c->aperf) /
+					        (mperf - c->mperf);
+					s->count[FREQ_EFFECTIVE]++;
+				}
+			}
+			c->aperf = aperf;
+			c->mperf = mperf;
+			c->valid = 1;
+		}
+
+		for (size_t s = 0; s < n_scopes && !stop; s++)
+			for (int k = 0; k < FREQ_MAX; k++) {
+				double value;
+
+				if (sensors[k] == NULL || !scopes[s].count[k])
+					continue;
+				if (k == FREQ_CYCLES)
+					value = scopes[s].cycles;
+				else
+					value = scopes[s].sum[k] /
+					        scopes[s].count[k];
+				nrm_log_debug("scope %zu %-10s %f\n", s,
+				              freq_names[k], value);
+				if (nrm_client_send_event(client, current_time,
+				                          sensors[k],
+				                          scopes[s].scope, value)) {
+					stop = 1;
+					break;
+				}
+			}
+	}
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	for (size_t i = 0; i < n_cpus; i++) {
+		if (cpus[i].cur_fd != -1)
+			close(cpus[i].cur_fd);
+		if (cpus[i].ref_fd != -1)
+			close(cpus[i].ref_fd);
+		if (cpus[i].counters_fd != -1)
+			close(cpus[i].counters_fd);
+	}
+	for (size_t s = 0; s < n_scopes; s++) {
+		if (scopes[s].added)
+			nrm_client_remove_scope(client, scopes[s].scope);
+		nrm_scope_destroy(scopes[s].scope);
+	}
+	nrm_log_debug("NRM scopes deleted.\n");
+
+	for (int k = 0; k < FREQ_MAX; k++)
+		if (sensors[k] != NULL)
+			nrm_sensor_destroy(&sensors[k]);
+	nrm_client_destroy(&client);
+
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+	free(cpus);
+	free(scopes);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,435 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmperf.c
+ *
+ * Description: Implements middleware between perf_event counters and the NRM
+ *               downstream interface. Reports, per CPU scope, instructions
+ *               per cycle, instruction throughput and the fraction of stalled
+ *               cycles. Where no hardware PMU is available (VMs, CI), falls
+ *               back to software events and only reports context switches.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+char *usage =
+        "usage: nrm-perf [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -s, --software          Use software events even if hardware counters are available\n"
+        "            -h, --help              Displays this help message\n";
+
+/* Counters of a group, the leader first. Hardware groups need the first two,
+ * stalled cycles are not exposed by every PMU.
+ */
+#define MAX_COUNTERS 3
+
+struct perf_counter {
+	uint32_t type;
+	uint64_t config;
+};
+
+static const struct perf_counter hw_counters[MAX_COUNTERS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+};
+
+/* No software clock event tells busy from idle: on a per-cpu event both
+ * cpu-clock and task-clock count whenever the event is enabled, idle included.
+ */
+static const struct perf_counter sw_counters[MAX_COUNTERS] = {
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+enum {
+	PERF_IPC,
+	PERF_INSTRUCTIONS,
+	PERF_STALLED,
+	PERF_CONTEXT_SWITCHES,
+	PERF_MAX,
+};
+
+static const char *perf_names[PERF_MAX] = {
+        "ipc", "instructions", "stalled", "context-switches",
+};
+
+/* raw group read, as returned by the kernel */
+struct perf_sample {
+	uint64_t enabled;
+	uint64_t running;
+	uint64_t values[MAX_COUNTERS];
+};
+
+struct perf_cpu {
+	int os_index;
+	size_t scope;
+	int fds[MAX_COUNTERS];
+	struct perf_sample last;
+	int valid;
+};
+
+struct perf_scope {
+	nrm_scope_t *scope;
+	int added;
+	double delta[MAX_COUNTERS];
+	size_t ncpus;
+};
+
+static const struct perf_counter *counters;
+static int n_counters;
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+static void close_group(struct perf_cpu *c)
+{
+	for (int k = MAX_COUNTERS - 1; k >= 0; k--)
+		if (c->fds[k] != -1) {
+			close(c->fds[k]);
+			c->fds[k] = -1;
+		}
+}
+
+/* Open at most n counters as one group on the cpu, returning how many were
+ * opened. Only the first, mandatory, counters of a set make it fail.
+ */
+static int open_group(struct perf_cpu *c,
+                      const struct perf_counter *set,
+                      int n,
+                      int required)
+{
+	struct perf_event_attr attr;
+	int k;
+
+	for (k = 0; k < n; k++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = set[k].type;
+		attr.config = set[k].config;
+		attr.read_format = PERF_FORMAT_GROUP |
+		                   PERF_FORMAT_TOTAL_TIME_ENABLED |
+		                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		c->fds[k] = nrm_extra_perf_event_open(
+		        &attr, -1, c->os_index, k == 0 ? -1 : c->fds[0], 0);
+		if (c->fds[k] == -1)
+			break;
+	}
+	if (k < required) {
+		nrm_log_debug("cpu %d: perf event %d failed: %s\n",
+		              c->os_index, k, strerror(errno));
+		close_group(c);
+		return 0;
+	}
+	return k;
+}
+
+/* One read() for the whole group: nr, time enabled, time running, then the
+ * values in group order. Counts are kept raw, scaling is done on deltas.
+ */
+static int read_group(struct perf_cpu *c, struct perf_sample *sample)
+{
+	uint64_t buf[3 + MAX_COUNTERS];
+	size_t size = (3 + n_counters) * sizeof(uint64_t);
+
+	if (read(c->fds[0], buf, size) != (ssize_t)size ||
+	    buf[0] != (uint64_t)n_counters)
+		return -NRM_FAILURE;
+	sample->enabled = buf[1];
+	sample->running = buf[2];
+	for (int k = 0; k < n_counters; k++)
+		sample->values[k] = buf[3 + k];
+	return 0;
+}
+
+/* Add the counts of the last interval to delta. When the kernel multiplexed
+ * the group, counts are scaled by the share of the interval it ran for, as
+ * perf stat -I does. Returns 0 if the group did not run at all.
+ */
+static int add_delta(const struct perf_sample *last,
+                     const struct perf_sample *now,
+                     double *delta)
+{
+	uint64_t enabled = now->enabled - last->enabled;
+	uint64_t running = now->running - last->running;
+	double scale = 1.0;
+
+	if (running == 0)
+		return 0;
+	if (running < enabled)
+		scale = (double)enabled / running;
+	for (int k = 0; k < n_counters; k++)
+		delta[k] += (now->values[k] - last->values[k]) * scale;
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	double freq = 1;
+	int software = 0;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"frequency", required_argument, 0, 'f'},
+		        {"software", no_argument, 0, 's'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhf:s", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 's':
+			software = 1;
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.perf") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	hwloc_topology_t topology;
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	// one CPU scope per NUMA node, as nrm-power-papi does
+	size_t n_scopes, n_cpus = 0;
+	struct perf_scope *scopes;
+	struct perf_cpu *cpus;
+
+	n_scopes = hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_NUMANODE);
+	scopes = calloc(n_scopes, sizeof(struct perf_scope));
+	cpus = calloc(hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_PU),
+	              sizeof(struct perf_cpu));
+	assert(scopes != NULL && cpus != NULL);
+
+	for (size_t s = 0; s < n_scopes; s++) {
+		hwloc_obj_t numanode;
+		int cpu;
+
+		err = nrm_extra_create_cpu_scope(client, topology, "nrm.perf", s,
+		                                 &scopes[s].scope,
+		                                 &scopes[s].added);
+		assert(err == 0);
+
+		numanode = hwloc_get_obj_by_type(topology, HWLOC_OBJ_NUMANODE, s);
+		hwloc_bitmap_foreach_begin(cpu, numanode->cpuset)
+		{
+			struct perf_cpu *c = &cpus[n_cpus++];
+			c->os_index = cpu;
+			c->scope = s;
+			for (int k = 0; k < MAX_COUNTERS; k++)
+				c->fds[k] = -1;
+		}
+		hwloc_bitmap_foreach_end();
+	}
+
+	// settle on a counter set with the first cpu, then use it everywhere
+	if (n_cpus > 0 && !software) {
+		n_counters = open_group(&cpus[0], hw_counters, MAX_COUNTERS, 2);
+		counters = hw_counters;
+	}
+	if (n_counters == 0 && n_cpus > 0) {
+		n_counters = open_group(&cpus[0], sw_counters, 1, 1);
+		counters = sw_counters;
+	}
+	if (n_counters == 0) {
+		nrm_log_error("No usable perf events, check perf_event_paranoid\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 1; i < n_cpus; i++)
+		if (open_group(&cpus[i], counters, n_counters, n_counters) !=
+		    n_counters)
+			nrm_log_error("cpu %d: cannot open perf events\n",
+			              cpus[i].os_index);
+	nrm_log_debug("%zu cpus over %zu scopes, %d %s counters\n", n_cpus,
+	              n_scopes, n_counters,
+	              counters == hw_counters ? "hardware" : "software");
+
+	nrm_sensor_t *sensors[PERF_MAX] = {NULL};
+	char name[64];
+	int first = PERF_CONTEXT_SWITCHES, last = PERF_CONTEXT_SWITCHES;
+	if (counters == hw_counters) {
+		first = PERF_IPC;
+		last = n_counters == MAX_COUNTERS ? PERF_STALLED
+		                                  : PERF_INSTRUCTIONS;
+	}
+	for (int k = first; k <= last; k++) {
+		snprintf(name, sizeof(name), "nrm.sensor.perf.%s",
+		         perf_names[k]);
+		sensors[k] = nrm_sensor_create(name);
+		assert(nrm_client_add_sensor(client, sensors[k]) == 0);
+	}
+
+	for (size_t i = 0; i < n_cpus; i++)
+		if (cpus[i].fds[0] != -1)
+			cpus[i].valid = !read_group(&cpus[i], &cpus[i].last);
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_time_t last_time, current_time;
+	int64_t elapsed_time;
+
+	nrm_time_gettime(&last_time);
+
+	stop = 0;
+	double sleeptime = 1 / freq;
+
+	while (!stop) {
+		/* sleep for a frequency */
+		struct timespec req, rem;
+		req.tv_sec = sleeptime;
+		req.tv_nsec = (sleeptime - req.tv_sec) * 1e9;
+
+		err = nanosleep(&req, &rem);
+		if (err == -1 && errno == EINTR)
+			continue;
+
+		nrm_time_gettime(&current_time);
+		elapsed_time = nrm_time_diff(&last_time, &current_time);
+		last_time = current_time;
+
+		for (size_t s = 0; s < n_scopes; s++) {
+			memset(scopes[s].delta, 0, sizeof(scopes[s].delta));
+			scopes[s].ncpus = 0;
+		}
+
+		for (size_t i = 0; i < n_cpus; i++) {
+			struct perf_cpu *c = &cpus[i];
+			struct perf_scope *s = &scopes[c->scope];
+			struct perf_sample sample;
+
+			if (c->fds[0] == -1 || read_group(c, &sample)) {
+				c->valid = 0;
+				continue;
+			}
+			if (c->valid)
+				s->ncpus += add_delta(&c->last, &sample, s->delta);
+			c->last = sample;
+			c->valid = 1;
+		}
+
+		for (size_t s = 0; s < n_scopes && !stop; s++) {
+			struct perf_scope *ps = &scopes[s];
+			double value[PERF_MAX];
+
+			if (ps->ncpus == 0 || elapsed_time <= 0)
+				continue;
+			if (counters == hw_counters) {
+				value[PERF_IPC] =
+				        ps->delta[0] > 0
+				                ? ps->delta[1] / ps->delta[0]
+				                : 0.0;
+				value[PERF_INSTRUCTIONS] =
+				        ps->delta[1] * 1e9 / elapsed_time;
+				value[PERF_STALLED] =
+				        ps->delta[0] > 0
+				                ? ps->delta[2] / ps->delta[0]
+				                : 0.0;
+			} else {
+				value[PERF_CONTEXT_SWITCHES] =
+				        ps->delta[0] * 1e9 / elapsed_time;
+			}
+			for (int k = 0; k < PERF_MAX; k++) {
+				if (sensors[k] == NULL)
+					continue;
+				nrm_log_debug("scope %zu %-16s %f\n", s,
+				              perf_names[k], value[k]);
+				if (nrm_client_send_event(client, current_time,
+				                          sensors[k], ps->scope,
+				                          value[k])) {
+					stop = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	for (size_t i = 0; i < n_cpus; i++)
+		close_group(&cpus[i]);
+	for (size_t s = 0; s < n_scopes; s++) {
+		if (scopes[s].added)
+			nrm_client_remove_scope(client, scopes[s].scope);
+		nrm_scope_destroy(scopes[s].scope);
+	}
+	nrm_log_debug("NRM scopes deleted.\n");
+
+	for (int k = 0; k < PERF_MAX; k++)
+		if (sensors[k] != NULL)
+			nrm_sensor_destroy(&sensors[k]);
+	nrm_client_destroy(&client);
+
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+	free(cpus);
+	free(scopes);
+
+	exit(EXIT_SUCCESS);
+}
@@ -21,6 +21,7 @@
 #include <hwloc.h>
 #include <math.h>
 #include <papi.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -34,7 +35,9 @@
 
 #include <nrm.h>
 
+#include "derived.h"
 #include "extra.h"
+#include "powercap.h"
 
 static int log_level = NRM_LOG_ERROR;
 volatile sig_atomic_t stop;
@@ -42,20 +45,80 @@ volatile sig_atomic_t stop;
 static nrm_client_t *client;
 static nrm_scope_t *scope;
 static nrm_sensor_t *sensor;
+static nrm_sensor_t *forecast_sensor;
+static nrm_sensor_t *suppressed_sensor;
 static int custom_scope = 0;
 
 static char *upstream_uri = "tcp://127.0.0.1";
 static int pub_port = 2345;
 static int rpc_port = 3456;
 
+static nrm_extra_deadband_t deadband = {0.0, 0.0, 10000000000LL};
+
+static unsigned int forecast_horizon;
+static unsigned int forecast_period = 0;
+
 char *usage =
         "usage: nrm-power [options] \n"
         "     options:\n"
         "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
-        "            -h, --help              Displays this help message\n";
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -a, --deadband-abs <w>  Only publish a scope when its power moved by more than <w> watts\n"
+        "            -r, --deadband-rel <f>  Only publish a scope when its power moved by more than a fraction <f>\n"
+        "            -b, --heartbeat <s>     Publish a scope at least every <s> seconds when a deadband is set\n"
+        "                                    Derived series go through the same deadband, on their own value\n"
+        "            -e, --derived <n=expr>  Also publish expr on the node scope, as sensor nrm.sensor.power-papi.<n>\n"
+        "            -d, --builtin           Also publish the built-in derived series (energy, package, dram,\n"
+        "                                    dram-share, energy-per-progress, edp)\n"
+        "            -p, --forecast <n>      Also publish the power forecast <n> periods ahead, as sensor\n"
+        "                                    nrm.sensor.power-papi.forecast (default: 0, disabled)\n"
+        "            -s, --season <n>        Account for a power pattern repeating every <n> periods in forecasts\n"
+        "            -h, --help              Displays this help message\n"
+        "     derived expressions:\n"
+        "            + - * / and parentheses over numbers and the variables pkg, dram (J,\n"
+        "            summed over the node), pkgN, dramN (J, per package), dt, t (s, since the\n"
+        "            previous sample and since startup) and progress (latest rate reported on\n"
+        "            nrm.sensor.progress). d(x) is the change of x over the last period.\n";
 
 #define MAX_powercap_EVENTS 128
 #define MAX_MEASUREMENTS 8
+#define MAX_DERIVED 32
+
+/* Inputs of derived expressions. The per-package energies follow the fixed
+ * ones, in energy event order.
+ */
+enum {
+	DERIVED_PKG,
+	DERIVED_DRAM,
+	DERIVED_DT,
+	DERIVED_T,
+	DERIVED_PROGRESS,
+	DERIVED_ZONES,
+};
+
+static const char *derived_builtins[][2] = {
+        {"energy", "pkg + dram"},
+        {"package", "pkg"},
+        {"dram", "dram"},
+        {"dram-share", "d(dram) / (d(pkg) + d(dram))"},
+        {"energy-per-progress", "d(pkg + dram) / dt / progress"},
+        {"edp", "(pkg + dram) * t"},
+};
+
+struct derived_series {
+	char *name;
+	const char *expr;
+	nrm_extra_derived_t *prog;
+	nrm_sensor_t *sensor;
+	nrm_extra_deadband_state_t deadband;
+};
+
+static struct derived_series derived[MAX_DERIVED];
+static int n_derived;
+static int derived_builtin;
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static double progress_rate;
 
 // handler for interrupt?
 void interrupt(int signum)
@@ -63,6 +126,31 @@ void interrupt(int signum)
 	stop = 1;
 }
 
+int progress_listener(nrm_string_t sensor_uuid,
+                      nrm_time_t time,
+                      nrm_scope_t *scope,
+                      double value)
+{
+	if (strcmp(sensor_uuid, "nrm.sensor.progress"))
+		return 0;
+	pthread_mutex_lock(&progress_lock);
+	progress_rate = value;
+	pthread_mutex_unlock(&progress_lock);
+	return 0;
+}
+
+int add_derived(const char *name, const char *expr)
+{
+	if (n_derived == MAX_DERIVED)
+		return -NRM_EINVAL;
+	derived[n_derived].name = strdup(name);
+	if (derived[n_derived].name == NULL)
+		return -NRM_ENOMEM;
+	derived[n_derived].expr = expr;
+	n_derived++;
+	return 0;
+}
+
 bool is_energy_event(const char *event_name, uint64_t data_type)
 {
 	return (strncmp(event_name, "powercap:::ENERGY_UJ:",
@@ -78,7 +166,7 @@ bool is_name_event(const char *event_name)
 
 bool is_dram_event(const char *event_desc)
 {
-	return strcmp(event_desc, "dram") == 0;
+	return nrm_extra_powercap_is_dram(event_desc);
 }
 
 double get_watts(double event_value, int64_t elapsed_time)
@@ -142,12 +230,7 @@ int get_package_id(char *event_name,
 	assert(zone_name_id != -1);
 	if (desc)
 		*desc = EventDescs[zone_name_id];
-	if (strncmp(EventDescs[zone_name_id], "package-", strlen("package-")) ==
-	    0)
-		return strtol(EventDescs[zone_name_id] + strlen("package-"),
-		              NULL, 10);
-	else
-		return -1;
+	return nrm_extra_powercap_package_id(EventDescs[zone_name_id]);
 }
 
 const char *
@@ -168,13 +251,6 @@ get_subzone_desc(char *event_name,
 	assert(0);
 }
 
-int get_cpu_idx(hwloc_topology_t topology, int cpu)
-{
-	hwloc_obj_t pu;
-	pu = hwloc_get_pu_obj_by_os_index(topology, cpu);
-	return pu->logical_index;
-}
-
 int main(int argc, char **argv)
 {
 	int i, j, char_opt, err;
@@ -185,10 +261,17 @@ int main(int argc, char **argv)
 		        {"verbose", no_argument, 0, 'v'},
 		        {"help", no_argument, 0, 'h'},
 		        {"frequency", required_argument, 0, 'f'},
+		        {"deadband-abs", required_argument, 0, 'a'},
+		        {"deadband-rel", required_argument, 0, 'r'},
+		        {"heartbeat", required_argument, 0, 'b'},
+		        {"derived", required_argument, 0, 'e'},
+		        {"builtin", no_argument, 0, 'd'},
+		        {"forecast", required_argument, 0, 'p'},
+		        {"season", required_argument, 0, 's'},
 		        {0, 0, 0, 0}};
 
 		int option_index = 0;
-		char_opt = getopt_long(argc, argv, "vhf:", long_options,
+		char_opt = getopt_long(argc, argv, "vhf:a:r:b:e:dp:s:", long_options,
 		                       &option_index);
 
 		if (char_opt == -1)
@@ -202,6 +285,43 @@ int main(int argc, char **argv)
 		case 'f':
 			freq = strtod(optarg, NULL);
 			break;
+		case 'a':
+			deadband.abs = strtod(optarg, NULL);
+			break;
+		case 'r':
+			deadband.rel = strtod(optarg, NULL);
+			break;
+		case 'b':
+			deadband.heartbeat = strtod(optarg, NULL) * 1e9;
+			break;
+		case 'e': {
+			char *expr = strchr(optarg, '=');
+			if (expr == NULL || expr == optarg) {
+				fprintf(stderr, "Expected name=expr: %s\n",
+				        optarg);
+				exit(EXIT_FAILURE);
+			}
+			*expr++ = '\0';
+			if (add_derived(optarg, expr)) {
+				fprintf(stderr, "Too many derived series\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'd':
+			derived_builtin = 1;
+			break;
+		case 'p':
+			forecast_horizon = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			forecast_period = strtoul(optarg, NULL, 10);
+			if (forecast_period > NRM_EXTRA_FORECAST_MAX_PERIOD) {
+				fprintf(stderr, "Season longer than %d periods\n",
+				        NRM_EXTRA_FORECAST_MAX_PERIOD);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'h':
 			fprintf(stderr, "%s", usage);
 			exit(EXIT_SUCCESS);
@@ -229,6 +349,19 @@ int main(int argc, char **argv)
 	// client add sensor
 	assert(nrm_client_add_sensor(client, sensor) == 0);
 
+	// samples the deadband held back, sent on publishes when it grew
+	if (nrm_extra_deadband_enabled(&deadband)) {
+		suppressed_sensor =
+		        nrm_sensor_create("nrm.sensor.power-papi.suppressed");
+		assert(nrm_client_add_sensor(client, suppressed_sensor) == 0);
+	}
+
+	if (forecast_horizon > 0) {
+		forecast_sensor =
+		        nrm_sensor_create("nrm.sensor.power-papi.forecast");
+		assert(nrm_client_add_sensor(client, forecast_sensor) == 0);
+	}
+
 	assert(PAPI_library_init(PAPI_VER_CURRENT) == PAPI_VER_CURRENT);
 	nrm_log_debug("PAPI initialized.\n");
 
@@ -304,18 +437,17 @@ int main(int argc, char **argv)
 	}
 
 	hwloc_topology_t topology;
-	hwloc_obj_t numanode;
-	hwloc_cpuset_t cpus;
 
 	// These arrays are indexed by energy event id [0..n_energy_events-1].
 	nrm_scope_t *nrm_scopes[MAX_MEASUREMENTS];
 	bool nrm_scopes_free[MAX_MEASUREMENTS];
 	const char *nrm_event_names[MAX_MEASUREMENTS];
+	bool nrm_event_dram[MAX_MEASUREMENTS];
+	int nrm_event_numa[MAX_MEASUREMENTS];
 
 	int n_energy_events = 0, n_scopes = 0, n_numa_scopes = 0,
-	    n_cpu_scopes = 0, cpu_idx, cpu, numa_id;
+	    n_cpu_scopes = 0, numa_id;
 	char *event;
-	char *scope_name;
 
 	assert(hwloc_topology_init(&topology) == 0);
 	assert(hwloc_topology_load(topology) == 0);
@@ -348,20 +480,10 @@ int main(int argc, char **argv)
 
 			if (subzone_desc != NULL) {
 				if (is_dram_event(subzone_desc)) {
-					err = nrm_extra_create_name_ssu(
-					        "nrm.papi", "numa", numa_id,
-					        &scope_name);
-					nrm_log_debug(
-					        "Creating new scope: %s\n",
-					        scope_name);
-
-					scope = nrm_scope_create(scope_name);
-					nrm_scope_add(scope,
-					              NRM_SCOPE_TYPE_NUMA,
-					              numa_id);
-					nrm_extra_find_scope(client, &scope,
-					                     &added);
-					free(scope_name);
+					err = nrm_extra_create_numa_scope(
+					        client, "nrm.papi", numa_id,
+					        &scope, &added);
+					assert(err == 0);
 
 					n_numa_scopes++;
 
@@ -376,25 +498,10 @@ int main(int argc, char **argv)
 				}
 			} else { // need NUMANODE object to parse CPU
 				 // indexes
-				err = nrm_extra_create_name_ssu("nrm.papi",
-				                                "cpu", numa_id,
-				                                &scope_name);
-				nrm_log_debug("Creating new scope: %s\n",
-				              scope_name);
-
-				scope = nrm_scope_create(scope_name);
-				numanode = hwloc_get_obj_by_type(
-				        topology, HWLOC_OBJ_NUMANODE, numa_id);
-				cpus = numanode->cpuset;
-				hwloc_bitmap_foreach_begin(cpu, cpus)
-				{
-					cpu_idx = get_cpu_idx(topology, cpu);
-					nrm_scope_add(scope, NRM_SCOPE_TYPE_CPU,
-					              cpu_idx);
-				}
-				hwloc_bitmap_foreach_end();
-				nrm_extra_find_scope(client, &scope, &added);
-				free(scope_name);
+				err = nrm_extra_create_cpu_scope(
+				        client, topology, "nrm.papi", numa_id,
+				        &scope, &added);
+				assert(err == 0);
 
 				n_cpu_scopes++;
 
@@ -405,6 +512,8 @@ int main(int argc, char **argv)
 			nrm_scopes[n_energy_events] = scope;
 			nrm_scopes_free[n_energy_events] = added;
 			nrm_event_names[n_energy_events] = event;
+			nrm_event_dram[n_energy_events] = subzone_desc != NULL;
+			nrm_event_numa[n_energy_events] = numa_id;
 			n_energy_events++;
 			if (added)
 				n_scopes++;
@@ -422,19 +531,79 @@ int main(int argc, char **argv)
 	nrm_log_debug("NRM scopes initialized: %d NUMA, %d CPU (%d new)\n",
 	              n_numa_scopes, n_cpu_scopes, n_scopes);
 
+	// derived series, compiled once and evaluated every sample on the
+	// node scope
+	const char *derived_vars[DERIVED_ZONES + MAX_MEASUREMENTS] = {
+	        "pkg", "dram", "dt", "t", "progress"};
+	char derived_zone_names[MAX_MEASUREMENTS][32];
+	double derived_values[DERIVED_ZONES + MAX_MEASUREMENTS] = {0};
+	nrm_scope_t *node_scope = NULL;
+	int node_scope_added = 0, derived_progress = 0;
+
+	for (i = 0; i < n_energy_events; i++) {
+		snprintf(derived_zone_names[i], sizeof(derived_zone_names[i]),
+		         "%s%d", nrm_event_dram[i] ? "dram" : "pkg",
+		         nrm_event_numa[i]);
+		derived_vars[DERIVED_ZONES + i] = derived_zone_names[i];
+	}
+	if (derived_builtin)
+		for (i = 0; i < (int)(sizeof(derived_builtins) /
+		                      sizeof(derived_builtins[0]));
+		     i++)
+			assert(add_derived(derived_builtins[i][0],
+			                   derived_builtins[i][1]) == 0);
+	for (i = 0; i < n_derived; i++) {
+		char name[128];
+
+		if (nrm_extra_derived_compile(derived[i].expr, derived_vars,
+		                              DERIVED_ZONES + n_energy_events,
+		                              &derived[i].prog)) {
+			nrm_log_error("invalid expression for %s\n",
+			              derived[i].name);
+			exit(EXIT_FAILURE);
+		}
+		if (nrm_extra_derived_uses(derived[i].prog, DERIVED_PROGRESS))
+			derived_progress = 1;
+		snprintf(name, sizeof(name), "nrm.sensor.power-papi.%s",
+		         derived[i].name);
+		derived[i].sensor = nrm_sensor_create(name);
+		assert(nrm_client_add_sensor(client, derived[i].sensor) == 0);
+	}
+	if (n_derived > 0) {
+		err = nrm_extra_create_node_scope(client, topology, "nrm.papi",
+		                                  &node_scope, &node_scope_added);
+		assert(err == 0);
+		nrm_log_debug("%d derived series\n", n_derived);
+	}
+	if (derived_progress) {
+		nrm_string_t topic = nrm_string_fromchar("nrm.sensor.progress");
+		nrm_client_set_event_listener(client, progress_listener);
+		assert(nrm_client_start_event_listener(client, topic) == 0);
+		nrm_string_decref(topic);
+	}
+
 	long long *event_values;
-	nrm_time_t last_time, current_time;
+	nrm_time_t start_time, last_time, current_time;
 	int64_t elapsed_time;
 	double watts_value, *event_totals;
+	nrm_extra_deadband_state_t *deadband_states;
+	nrm_extra_forecast_t *forecasts;
 
 	event_values = calloc(n_energy_events, sizeof(long long));
 	event_totals = calloc(n_energy_events, sizeof(double)); // converting
 	                                                        // then storing
+	deadband_states =
+	        calloc(n_energy_events, sizeof(nrm_extra_deadband_state_t));
+	forecasts = calloc(n_energy_events, sizeof(nrm_extra_forecast_t));
+	for (i = 0; i < n_energy_events; i++)
+		assert(nrm_extra_forecast_init(&forecasts[i], 0.5, 0.1, 0.3,
+		                               forecast_period) == 0);
 
 	// register callback handler for interrupt
 	signal(SIGINT, interrupt);
 
 	nrm_time_gettime(&last_time);
+	start_time = last_time;
 
 	assert(PAPI_start(EventSet) == PAPI_OK);
 
@@ -469,6 +638,22 @@ int main(int argc, char **argv)
 			              nrm_event_names[i], event_totals[i],
 			              watts_value);
 
+			if (forecast_horizon > 0)
+				nrm_extra_forecast_update(&forecasts[i],
+				                          watts_value);
+
+			// energy is cumulative, so skipping a publish loses
+			// nothing: the next one carries the whole delta.
+			if (!nrm_extra_deadband_update(&deadband,
+			                               &deadband_states[i],
+			                               current_time,
+			                               watts_value)) {
+				nrm_log_debug("%-45ssuppressed (%lu so far)\n",
+				              nrm_event_names[i],
+				              deadband_states[i].suppressed);
+				continue;
+			}
+
 			scope = nrm_scopes[i];
 
 			if (nrm_client_send_event(client, current_time, sensor,
@@ -476,6 +661,69 @@ int main(int argc, char **argv)
 				stop = 1;
 				break;
 			}
+			// the count only moves between publishes, only send
+			// it when it did
+			if (suppressed_sensor != NULL &&
+			    deadband_states[i].suppressed !=
+			            deadband_states[i].suppressed_sent) {
+				if (nrm_client_send_event(
+				            client, current_time,
+				            suppressed_sensor, scope,
+				            deadband_states[i].suppressed)) {
+					stop = 1;
+					break;
+				}
+				deadband_states[i].suppressed_sent =
+				        deadband_states[i].suppressed;
+			}
+
+			if (forecast_horizon == 0)
+				continue;
+			double predicted = nrm_extra_forecast_predict(
+			        &forecasts[i], forecast_horizon);
+			nrm_log_debug("%-45s%f W in %u periods\n",
+			              nrm_event_names[i], predicted,
+			              forecast_horizon);
+			if (nrm_client_send_event(client, current_time,
+			                          forecast_sensor, scope,
+			                          predicted)) {
+				stop = 1;
+				break;
+			}
+		}
+
+		derived_values[DERIVED_PKG] = 0.0;
+		derived_values[DERIVED_DRAM] = 0.0;
+		for (i = 0; i < n_energy_events; i++) {
+			derived_values[DERIVED_ZONES + i] = event_totals[i];
+			derived_values[nrm_event_dram[i] ? DERIVED_DRAM
+			                                 : DERIVED_PKG] +=
+			        event_totals[i];
+		}
+		derived_values[DERIVED_DT] = elapsed_time / 1e9;
+		derived_values[DERIVED_T] =
+		        nrm_time_diff(&start_time, &current_time) / 1e9;
+		if (derived_progress) {
+			pthread_mutex_lock(&progress_lock);
+			derived_values[DERIVED_PROGRESS] = progress_rate;
+			pthread_mutex_unlock(&progress_lock);
+		}
+		for (i = 0; i < n_derived && !stop; i++) {
+			double value = nrm_extra_derived_eval(derived[i].prog,
+			                                      derived_values);
+
+			// no delta yet, or nothing to divide by
+			if (!isfinite(value))
+				continue;
+			nrm_log_debug("%-45s%f\n", derived[i].name, value);
+			if (!nrm_extra_deadband_update(&deadband,
+			                               &derived[i].deadband,
+			                               current_time, value))
+				continue;
+			if (nrm_client_send_event(client, current_time,
+			                          derived[i].sensor, node_scope,
+			                          value))
+				stop = 1;
 		}
 
 		last_time = current_time;
@@ -483,22 +731,45 @@ int main(int argc, char **argv)
 
 	nrm_log_error("Interrupt caught; exiting\n");
 
+	if (nrm_extra_deadband_enabled(&deadband))
+		for (i = 0; i < n_energy_events; i++)
+			nrm_log_info("%-45s%lu samples suppressed\n",
+			             nrm_event_names[i],
+			             deadband_states[i].suppressed);
+
 	for (i = 0; i < n_scopes; i++)
 		if (nrm_scopes_free[i]) {
 			nrm_client_remove_scope(client, nrm_scopes[i]);
 			nrm_scope_destroy(nrm_scopes[i]);
 		}
+	if (node_scope != NULL) {
+		if (node_scope_added)
+			nrm_client_remove_scope(client, node_scope);
+		nrm_scope_destroy(node_scope);
+	}
 	nrm_log_debug("NRM scopes deleted.\n");
 
 	for (i = 0; i < num_events; i++)
 		free(EventDescs[i]);
 
+	for (i = 0; i < n_derived; i++) {
+		nrm_extra_derived_destroy(&derived[i].prog);
+		nrm_sensor_destroy(&derived[i].sensor);
+		free(derived[i].name);
+	}
+
 	nrm_sensor_destroy(&sensor);
+	if (suppressed_sensor != NULL)
+		nrm_sensor_destroy(&suppressed_sensor);
+	if (forecast_sensor != NULL)
+		nrm_sensor_destroy(&forecast_sensor);
 	nrm_client_destroy(&client);
 
 	nrm_finalize();
 	free(event_values);
 	free(event_totals);
+	free(deadband_states);
+	free(forecasts);
 
 	exit(EXIT_SUCCESS);
 }
@@ -14,7 +14,8 @@
  *               and the NRM downstream interface.
  */
 
-#define _GNU_SOURCE
+#include "config.h"
+
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
@@ -27,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -42,15 +44,22 @@ volatile sig_atomic_t stop;
 static nrm_client_t *client;
 static nrm_scope_t *scope;
 static nrm_sensor_t *sensor;
+static nrm_sensor_t *suppressed_sensor;
 
 static char *upstream_uri = "tcp://127.0.0.1";
 static int pub_port = 2345;
 static int rpc_port = 3456;
 
+static nrm_extra_deadband_t deadband = {0.0, 0.0, 10000000000LL};
+
 char *usage =
         "usage: nrm-power [options] \n"
         "     options:\n"
         "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -a, --deadband-abs <w>  Only publish a scope when its power moved by more than <w> watts\n"
+        "            -r, --deadband-rel <f>  Only publish a scope when its power moved by more than a fraction <f>\n"
+        "            -b, --heartbeat <s>     Publish a scope at least every <s> seconds when a deadband is set\n"
         "            -h, --help              Displays this help message\n";
 
 #define MAX_MEASUREMENTS 16
@@ -69,6 +78,52 @@ int get_cpu_idx(hwloc_topology_t topology, int cpu)
 	return pu->logical_index;
 }
 
+#if HAVE_VARIORUM_ENERGY
+/* The layout of variorum_get_energy_json changed across releases and
+ * architectures: flat keys (energy_cpu_joules_socket_0) or per-socket
+ * objects (Socket_0: {energy_cpu_joules}), possibly under a hostname
+ * object. Look for the counter matching a power key under either, and
+ * let the caller integrate power when there is none.
+ */
+static json_t *find_energy(json_t *obj, const char *power_key, int depth)
+{
+	const char *watts = strstr(power_key, "_watts");
+	const char *socket = strstr(power_key, "_socket_");
+	char flat[128], inner[128], sock[32];
+	json_t *value, *found;
+	const char *key;
+
+	if (strncmp(power_key, "power_", strlen("power_")) || watts == NULL ||
+	    socket == NULL || !json_is_object(obj))
+		return NULL;
+	snprintf(inner, sizeof(inner), "energy_%.*s_joules",
+	         (int)(watts - power_key - strlen("power_")),
+	         power_key + strlen("power_"));
+	snprintf(flat, sizeof(flat), "%s%s", inner, socket);
+	snprintf(sock, sizeof(sock), "Socket_%s", socket + strlen("_socket_"));
+
+	value = json_object_get(obj, flat);
+	if (json_is_number(value))
+		return value;
+	json_object_foreach(obj, key, value)
+	{
+		if (!json_is_object(value))
+			continue;
+		if (!strcasecmp(key, sock)) {
+			found = json_object_get(value, inner);
+			if (json_is_number(found))
+				return found;
+		}
+		if (depth > 0) {
+			found = find_energy(value, power_key, depth - 1);
+			if (found != NULL)
+				return found;
+		}
+	}
+	return NULL;
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	int char_opt, err;
@@ -84,10 +139,13 @@ int main(int argc, char **argv)
 		        {"verbose", no_argument, &log_level, 1},
 		        {"help", no_argument, 0, 'h'},
 		        {"frequency", required_argument, 0, 'f'},
+		        {"deadband-abs", required_argument, 0, 'a'},
+		        {"deadband-rel", required_argument, 0, 'r'},
+		        {"heartbeat", required_argument, 0, 'b'},
 		        {0, 0, 0, 0}};
 
 		int option_index = 0;
-		char_opt = getopt_long(argc, argv, "vhf:", long_options,
+		char_opt = getopt_long(argc, argv, "vhf:a:r:b:", long_options,
 		                       &option_index);
 
 		if (char_opt == -1)
@@ -101,6 +159,15 @@ int main(int argc, char **argv)
 		case 'f':
 			freq = strtod(optarg, NULL);
 			break;
+		case 'a':
+			deadband.abs = strtod(optarg, NULL);
+			break;
+		case 'r':
+			deadband.rel = strtod(optarg, NULL);
+			break;
+		case 'b':
+			deadband.heartbeat = strtod(optarg, NULL) * 1e9;
+			break;
 		case 'h':
 			fprintf(stderr, "%s", usage);
 			exit(EXIT_SUCCESS);
@@ -129,6 +196,13 @@ int main(int argc, char **argv)
 	// client add sensor
 	assert(nrm_client_add_sensor(client, sensor) == 0);
 
+	// samples the deadband held back, sent on publishes when it grew
+	if (nrm_extra_deadband_enabled(&deadband)) {
+		suppressed_sensor = nrm_sensor_create(
+		        "nrm.sensor.power-variorum.suppressed");
+		assert(nrm_client_add_sensor(client, suppressed_sensor) == 0);
+	}
+
 	// 1st measure, only to determine viable measurements
 	// without delta, watts values should all be zero
 	// but since we're not reporting yet, that's ok
@@ -153,6 +227,7 @@ int main(int argc, char **argv)
 	char *scope_name;
 	json_t *value, *json_measurements = json_object();
 	double *value_totals;
+	nrm_extra_deadband_state_t *deadband_states;
 
 	assert(hwloc_topology_init(&topology) == 0);
 	assert(hwloc_topology_load(topology) == 0);
@@ -213,22 +288,40 @@ int main(int argc, char **argv)
 
 	// loop until ctrl+c interrupt?
 	stop = 0;
-	double sleeptime = 1;
+	double sleeptime = 1 / freq;
 
-	nrm_time_t before_time, after_time;
+	nrm_time_t last_time, current_time;
 	int64_t elapsed_time;
-
+	double *last_watts;
+	int *have_last;
+#if HAVE_VARIORUM_ENERGY
+	char *str_energy;
+	json_t *json_energy = NULL, *energy;
+	double *last_energy;
+	int *have_energy;
+
+	last_energy = calloc(n_scopes, sizeof(double));
+	have_energy = calloc(n_scopes, sizeof(int));
+#endif
+
+	// totals are energy in joules: integrated from the instantaneous
+	// power samples over the measured time between two samples, unless
+	// variorum has an energy counter for the same field.
 	value_totals = calloc(n_scopes, sizeof(double));
+	last_watts = calloc(n_scopes, sizeof(double));
+	have_last = calloc(n_scopes, sizeof(int));
+	deadband_states = calloc(n_scopes, sizeof(nrm_extra_deadband_state_t));
+
+	nrm_time_gettime(&last_time);
 
 	nrm_log_debug("Beginning loop. ctrl+c to exit.\n");
 	do {
 		int count = 0;
-		nrm_time_gettime(&before_time);
 
 		/* sleep for a frequency */
 		struct timespec req, rem;
-		req.tv_sec = ceil(sleeptime);
-		req.tv_nsec = sleeptime * 1e9 - ceil(sleeptime) * 1e9;
+		req.tv_sec = sleeptime;
+		req.tv_nsec = (sleeptime - req.tv_sec) * 1e9;
 
 		err = nanosleep(&req, &rem);
 		if (err == -1 && errno == EINTR) {
@@ -236,12 +329,24 @@ int main(int argc, char **argv)
 			break;
 		}
 
-		nrm_time_gettime(&after_time);
-		elapsed_time = nrm_time_diff(&before_time, &after_time);
-
+		json_decref(json_measurements);
+		free(str_measurements);
 		assert(variorum_get_node_power_json(&str_measurements) == 0);
 		json_measurements =
 		        json_loads(str_measurements, JSON_DECODE_ANY, NULL);
+#if HAVE_VARIORUM_ENERGY
+		json_decref(json_energy);
+		json_energy = NULL;
+		if (variorum_get_energy_json(&str_energy) == 0) {
+			json_energy =
+			        json_loads(str_energy, JSON_DECODE_ANY, NULL);
+			free(str_energy);
+		}
+#endif
+
+		nrm_time_gettime(&current_time);
+		elapsed_time = nrm_time_diff(&last_time, &current_time);
+		last_time = current_time;
 
 		json_object_foreach(json_measurements, key, value)
 		{
@@ -249,13 +354,44 @@ int main(int argc, char **argv)
 			// 0.0
 			if (strstr(key, "socket") &&
 			    (json_real_value(value) != -1.0)) {
+				double watts = json_real_value(value);
+				int counted = 0;
+
 				numa_id = key[strlen(key) - 1] - '0';
 
 				nrm_log_debug("COUNT %d\n", count);
 
-				value_totals[count] +=
-				        json_real_value(value); // returns
-				                                // double
+#if HAVE_VARIORUM_ENERGY
+				energy = find_energy(json_energy, key, 1);
+				if (energy == NULL && !have_last[count])
+					nrm_log_info("%s: no energy counter, "
+					             "integrating power\n",
+					             key);
+				if (energy != NULL) {
+					double joules = json_number_value(energy);
+					if (have_energy[count] &&
+					    joules >= last_energy[count]) {
+						value_totals[count] +=
+						        joules -
+						        last_energy[count];
+						counted = 1;
+					}
+					last_energy[count] = joules;
+					have_energy[count] = 1;
+				}
+#endif
+				// trapezoidal rule, or a rectangle for the
+				// first sample
+				if (!counted) {
+					double prev = have_last[count]
+					                      ? last_watts[count]
+					                      : watts;
+					value_totals[count] += (prev + watts) /
+					                       2 *
+					                       (elapsed_time / 1e9);
+				}
+				last_watts[count] = watts;
+				have_last[count] = 1;
 
 				if (strstr(key, "power_cpu_watts")) {
 					scope = nrm_cpu_scopes[numa_id];
@@ -263,12 +399,32 @@ int main(int argc, char **argv)
 					scope = nrm_numa_scopes[numa_id];
 				}
 
-				nrm_log_debug("%s: TOTAL Power: %fW\n", key,
-				              value_totals[count]);
-
-				nrm_client_send_event(client, after_time,
-				                      sensor, scope,
-				                      value_totals[count]);
+				nrm_log_debug("%s: %fW, TOTAL Energy: %fJ\n",
+				              key, watts, value_totals[count]);
+
+				if (nrm_extra_deadband_update(
+				            &deadband, &deadband_states[count],
+				            current_time, watts)) {
+					nrm_client_send_event(
+					        client, current_time, sensor,
+					        scope, value_totals[count]);
+					nrm_extra_deadband_state_t *st =
+					        &deadband_states[count];
+					if (suppressed_sensor != NULL &&
+					    st->suppressed !=
+					            st->suppressed_sent) {
+						nrm_client_send_event(
+						        client, current_time,
+						        suppressed_sensor, scope,
+						        st->suppressed);
+						st->suppressed_sent =
+						        st->suppressed;
+					}
+				} else
+					nrm_log_debug(
+					        "%s: suppressed (%lu so far)\n",
+					        key,
+					        deadband_states[count].suppressed);
 				count++;
 			}
 		}
@@ -283,6 +439,11 @@ int main(int argc, char **argv)
 	/* final send here */
 	/* finalize program */
 
+	if (nrm_extra_deadband_enabled(&deadband))
+		for (i = 0; i < n_scopes; i++)
+			nrm_log_info("scope %d: %lu samples suppressed\n", i,
+			             deadband_states[i].suppressed);
+
 	for (i = 0; i < n_custom_scopes; i++) {
 		nrm_client_remove_scope(client, custom_scopes[i]);
 	}
@@ -298,9 +459,19 @@ int main(int argc, char **argv)
 	nrm_log_debug("NRM scopes deleted.\n");
 
 	nrm_sensor_destroy(&sensor);
+	if (suppressed_sensor != NULL)
+		nrm_sensor_destroy(&suppressed_sensor);
 	nrm_client_destroy(&client);
 	nrm_finalize();
 	free(value_totals);
+	free(last_watts);
+	free(have_last);
+	free(deadband_states);
+#if HAVE_VARIORUM_ENERGY
+	free(last_energy);
+	free(have_energy);
+	json_decref(json_energy);
+#endif
 	free(str_measurements);
 	json_decref(json_measurements);
 
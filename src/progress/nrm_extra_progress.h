@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#ifndef NRM_EXTRA_PROGRESS_H
+#define NRM_EXTRA_PROGRESS_H 1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Application progress reporting.
+ *
+ * nrm_extra_progress_init() connects to nrmd and starts a background thread
+ * that, at the given frequency (in Hz, 0 for the default of 1Hz), publishes
+ * the rate of progress of the whole process on the "nrm.sensor.progress"
+ * sensor, in units per second, on the scope of the cpus and memory the
+ * process is allowed to use. The library leaves libnrm to the caller: call
+ * nrm_init() (and nrm_log_init() to see its messages) before init, and
+ * nrm_finalize() after fini.
+ *
+ * nrm_extra_progress_add() is meant for inner loops: it only touches a
+ * counter private to the calling thread and never blocks, except the first
+ * time a thread calls it. It can be called before init and after fini, the
+ * progress is then simply not reported.
+ *
+ * The per-thread state uses initial-exec TLS: link against the library
+ * rather than dlopen() it.
+ */
+int nrm_extra_progress_init(double frequency);
+void nrm_extra_progress_add(uint64_t n);
+int nrm_extra_progress_fini(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,284 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: progress.c
+ *
+ * Description: Application progress library. Each thread increments its own
+ *               counter, padded to a cache line so that threads never share
+ *               one, and a flusher thread periodically sums them and
+ *               publishes the rate of progress to NRM.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+#include "nrm_extra_progress.h"
+
+#define PROGRESS_CACHE_LINE 64
+
+/* The owning thread is the only writer of count, so increments are a plain
+ * load and store: atomics only keep the flusher from reading torn values.
+ */
+struct progress_slot {
+	_Atomic uint64_t count;
+	struct progress_slot *next;
+} __attribute__((aligned(PROGRESS_CACHE_LINE)));
+
+static __thread struct progress_slot *progress_self
+        __attribute__((tls_model("initial-exec")));
+
+/* slots of live threads, and slots of exited threads waiting for reuse */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct progress_slot *progress_slots;
+static struct progress_slot *progress_free;
+static uint64_t progress_retired;
+static pthread_key_t progress_key;
+static pthread_once_t progress_key_once = PTHREAD_ONCE_INIT;
+static int progress_key_err;
+
+static pthread_mutex_t progress_flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t progress_flusher_thread;
+static int progress_running;
+static int progress_stop;
+static double progress_period;
+
+static nrm_client_t *progress_client;
+static nrm_scope_t *progress_scope;
+static int progress_scope_added;
+static nrm_sensor_t *progress_sensor;
+static uint64_t progress_last;
+static nrm_time_t progress_last_time;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+static void progress_slot_release(void *arg)
+{
+	struct progress_slot *slot = arg, **p;
+
+	// keep the progress of exited threads in the total
+	pthread_mutex_lock(&progress_lock);
+	progress_retired += atomic_load_explicit(&slot->count,
+	                                         memory_order_relaxed);
+	atomic_store_explicit(&slot->count, 0, memory_order_relaxed);
+	for (p = &progress_slots; *p != NULL; p = &(*p)->next)
+		if (*p == slot) {
+			*p = slot->next;
+			break;
+		}
+	slot->next = progress_free;
+	progress_free = slot;
+	pthread_mutex_unlock(&progress_lock);
+
+	// the slot may go to another thread now. Runs on the exiting thread:
+	// an add from a later TLS destructor registers a fresh slot, which
+	// the next round of key destructors releases.
+	progress_self = NULL;
+}
+
+static void progress_key_create(void)
+{
+	progress_key_err =
+	        pthread_key_create(&progress_key, progress_slot_release);
+}
+
+static struct progress_slot *progress_slot_register(void)
+{
+	struct progress_slot *slot;
+
+	pthread_once(&progress_key_once, progress_key_create);
+	if (progress_key_err)
+		return NULL;
+
+	pthread_mutex_lock(&progress_lock);
+	slot = progress_free;
+	if (slot != NULL)
+		progress_free = slot->next;
+	else
+		slot = aligned_alloc(PROGRESS_CACHE_LINE, sizeof(*slot));
+	if (slot != NULL) {
+		atomic_init(&slot->count, 0);
+		slot->next = progress_slots;
+		progress_slots = slot;
+	}
+	pthread_mutex_unlock(&progress_lock);
+
+	if (slot != NULL)
+		pthread_setspecific(progress_key, slot);
+	progress_self = slot;
+	return slot;
+}
+
+void nrm_extra_progress_add(uint64_t n)
+{
+	struct progress_slot *slot = progress_self;
+
+	if (__builtin_expect(slot == NULL, 0)) {
+		slot = progress_slot_register();
+		if (slot == NULL)
+			return;
+	}
+	atomic_store_explicit(
+	        &slot->count,
+	        atomic_load_explicit(&slot->count, memory_order_relaxed) + n,
+	        memory_order_relaxed);
+}
+
+static uint64_t progress_total(void)
+{
+	struct progress_slot *slot;
+	uint64_t total;
+
+	pthread_mutex_lock(&progress_lock);
+	total = progress_retired;
+	for (slot = progress_slots; slot != NULL; slot = slot->next)
+		total += atomic_load_explicit(&slot->count,
+		                              memory_order_relaxed);
+	pthread_mutex_unlock(&progress_lock);
+	return total;
+}
+
+static int progress_publish(void)
+{
+	nrm_time_t now;
+	uint64_t total;
+	int64_t elapsed;
+
+	nrm_time_gettime(&now);
+	total = progress_total();
+	elapsed = nrm_time_diff(&progress_last_time, &now);
+	if (elapsed <= 0)
+		return 0;
+
+	double rate = (total - progress_last) * 1e9 / elapsed;
+	nrm_log_debug("progress %lu rate %f\n", (unsigned long)total, rate);
+	progress_last = total;
+	progress_last_time = now;
+	return nrm_client_send_event(progress_client, now, progress_sensor,
+	                             progress_scope, rate);
+}
+
+static void *progress_flusher(void *arg)
+{
+	struct timespec deadline;
+	int err;
+
+	pthread_mutex_lock(&progress_flusher_lock);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	while (!progress_stop) {
+		deadline.tv_sec += (time_t)progress_period;
+		deadline.tv_nsec += (progress_period - (time_t)progress_period) *
+		                    1e9;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		// spurious wakeups keep waiting for the same deadline
+		do
+			err = pthread_cond_timedwait(&progress_flusher_cond,
+			                             &progress_flusher_lock,
+			                             &deadline);
+		while (!progress_stop && err != ETIMEDOUT);
+		if (progress_stop)
+			break;
+		if (progress_publish()) {
+			nrm_log_error("failed to publish progress\n");
+			break;
+		}
+	}
+	pthread_mutex_unlock(&progress_flusher_lock);
+	return NULL;
+}
+
+int nrm_extra_progress_init(double frequency)
+{
+	int err;
+
+	if (progress_running)
+		return -NRM_EINVAL;
+	if (frequency < 0)
+		return -NRM_EINVAL;
+	progress_period = frequency > 0 ? 1 / frequency : 1;
+
+	nrm_client_create(&progress_client, upstream_uri, pub_port, rpc_port);
+	if (progress_client == NULL)
+		return -NRM_FAILURE;
+
+	err = nrm_extra_find_allowed_scope(progress_client, "nrm.progress",
+	                                   &progress_scope,
+	                                   &progress_scope_added);
+	if (err)
+		goto err_client;
+
+	progress_sensor = nrm_sensor_create("nrm.sensor.progress");
+	if (progress_sensor == NULL) {
+		err = -NRM_ENOMEM;
+		goto err_scope;
+	}
+	err = nrm_client_add_sensor(progress_client, progress_sensor);
+	if (err)
+		goto err_sensor;
+
+	progress_last = progress_total();
+	nrm_time_gettime(&progress_last_time);
+	progress_stop = 0;
+	if (pthread_create(&progress_flusher_thread, NULL, progress_flusher,
+	                   NULL)) {
+		err = -NRM_FAILURE;
+		goto err_sensor;
+	}
+	progress_running = 1;
+	return 0;
+
+err_sensor:
+	nrm_sensor_destroy(&progress_sensor);
+err_scope:
+	if (progress_scope_added)
+		nrm_client_remove_scope(progress_client, progress_scope);
+	nrm_scope_destroy(progress_scope);
+err_client:
+	nrm_client_destroy(&progress_client);
+	return err;
+}
+
+int nrm_extra_progress_fini(void)
+{
+	if (!progress_running)
+		return -NRM_EINVAL;
+
+	pthread_mutex_lock(&progress_flusher_lock);
+	progress_stop = 1;
+	pthread_cond_signal(&progress_flusher_cond);
+	pthread_mutex_unlock(&progress_flusher_lock);
+	pthread_join(progress_flusher_thread, NULL);
+
+	// report whatever happened since the last period
+	progress_publish();
+
+	if (progress_scope_added)
+		nrm_client_remove_scope(progress_client, progress_scope);
+	nrm_scope_destroy(progress_scope);
+	nrm_sensor_destroy(&progress_sensor);
+	nrm_client_destroy(&progress_client);
+	progress_running = 0;
+	return 0;
+}
@@ -0,0 +1,410 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmpsi.c
+ *
+ * Description: Implements middleware between Linux Pressure Stall
+ *               Information and the NRM downstream interface. System-wide
+ *               pressure is reported on the node scope, the pressure of our
+ *               cgroup on the allowed scope. PSI triggers wake the sensor up
+ *               as soon as a stall threshold is crossed, a heartbeat period
+ *               bounds the time between two reports otherwise.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+char *usage =
+        "usage: nrm-psi [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Heartbeat frequency, when no trigger fires\n"
+        "            -c, --cgroup <dir>      cgroup to report on the allowed scope (default: our own)\n"
+        "            -t, --threshold <ms>    Stall time that fires a trigger, per window (default: 100)\n"
+        "            -w, --window <ms>       Trigger window (default: 2000)\n"
+        "            -h, --help              Displays this help message\n";
+
+enum {
+	PSI_CPU,
+	PSI_MEMORY,
+	PSI_IO,
+	PSI_MAX,
+};
+
+static const char *psi_resources[PSI_MAX] = {"cpu", "memory", "io"};
+
+enum {
+	PSI_SOME,
+	PSI_FULL,
+	PSI_LINES,
+};
+
+static const char *psi_lines[PSI_LINES] = {"some", "full"};
+
+enum {
+	PSI_AVG10,
+	PSI_STALL,
+	PSI_VALUES,
+};
+
+static const char *psi_values[PSI_VALUES] = {"avg10", "stall"};
+
+struct psi_source {
+	int resource;
+	int fd;
+	int trigger_fd;
+	nrm_scope_t *scope;
+	double avg10[PSI_LINES];
+	uint64_t total[PSI_LINES], last[PSI_LINES];
+	int have[PSI_LINES], valid[PSI_LINES];
+};
+
+static struct psi_source sources[2 * PSI_MAX];
+static size_t n_sources;
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+/* Parse lines like
+ * "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+ */
+static void psi_parse(struct psi_source *s, char *buf)
+{
+	char *line, *next, *p;
+
+	for (line = buf; line != NULL && *line != '\0'; line = next) {
+		int l;
+
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		if (!strncmp(line, "some ", 5))
+			l = PSI_SOME;
+		else if (!strncmp(line, "full ", 5))
+			l = PSI_FULL;
+		else
+			continue;
+		p = strstr(line, "avg10=");
+		if (p == NULL)
+			continue;
+		s->avg10[l] = strtod(p + strlen("avg10="), NULL);
+		p = strstr(line, "total=");
+		if (p == NULL)
+			continue;
+		s->total[l] = strtoull(p + strlen("total="), NULL, 10);
+		s->have[l] = 1;
+	}
+}
+
+static int psi_read(struct psi_source *s)
+{
+	char buf[256];
+	ssize_t n;
+
+	n = pread(s->fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return -NRM_FAILURE;
+	buf[n] = '\0';
+	s->have[PSI_SOME] = s->have[PSI_FULL] = 0;
+	psi_parse(s, buf);
+	return 0;
+}
+
+static void add_source(const char *path,
+                       int resource,
+                       nrm_scope_t *scope,
+                       const char *trigger)
+{
+	struct psi_source *s = &sources[n_sources];
+
+	s->fd = open(path, O_RDONLY);
+	if (s->fd == -1) {
+		nrm_log_debug("cannot open %s, skipping\n", path);
+		return;
+	}
+	s->resource = resource;
+	s->scope = scope;
+
+	// a trigger is armed by writing it to its own descriptor, and lives
+	// as long as that descriptor is open.
+	s->trigger_fd = open(path, O_RDWR | O_NONBLOCK);
+	if (s->trigger_fd != -1 &&
+	    write(s->trigger_fd, trigger, strlen(trigger) + 1) < 0) {
+		nrm_log_debug("cannot arm trigger on %s: %s\n", path,
+		              strerror(errno));
+		close(s->trigger_fd);
+		s->trigger_fd = -1;
+	}
+	nrm_log_debug("reading %s%s\n", path,
+	              s->trigger_fd != -1 ? ", trigger armed" : "");
+	n_sources++;
+}
+
+static int cgroup_self(char *buf, size_t size)
+{
+	char line[PATH_MAX];
+	int err = -NRM_EINVAL;
+	FILE *f;
+
+	// cgroup v2 has a single "0::/path" line
+	f = fopen("/proc/self/cgroup", "r");
+	if (f == NULL)
+		return -NRM_EINVAL;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(buf, size, "/sys/fs/cgroup%s",
+		         strcmp(line + 3, "/") ? line + 3 : "");
+		err = 0;
+		break;
+	}
+	fclose(f);
+	return err;
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	double freq = 1;
+	char *cgroup = NULL;
+	long threshold = 100, window = 2000;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"frequency", required_argument, 0, 'f'},
+		        {"cgroup", required_argument, 0, 'c'},
+		        {"threshold", required_argument, 0, 't'},
+		        {"window", required_argument, 0, 'w'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhf:c:t:w:", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 'c':
+			cgroup = optarg;
+			break;
+		case 't':
+			threshold = strtol(optarg, NULL, 10);
+			break;
+		case 'w':
+			window = strtol(optarg, NULL, 10);
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.psi") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	hwloc_topology_t topology;
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	nrm_scope_t *node, *allowed;
+	int node_added, allowed_added;
+	err = nrm_extra_create_node_scope(client, topology, "nrm.psi", &node,
+	                                  &node_added);
+	assert(err == 0);
+	err = nrm_extra_find_allowed_scope(client, "nrm.psi", &allowed,
+	                                   &allowed_added);
+	assert(err == 0);
+
+	char path[PATH_MAX], cgroup_path[PATH_MAX], trigger[64];
+	snprintf(trigger, sizeof(trigger), "some %ld %ld", threshold * 1000,
+	         window * 1000);
+
+	for (int r = 0; r < PSI_MAX; r++) {
+		snprintf(path, sizeof(path), "/proc/pressure/%s",
+		         psi_resources[r]);
+		add_source(path, r, node, trigger);
+	}
+	if (cgroup == NULL && !cgroup_self(cgroup_path, sizeof(cgroup_path)))
+		cgroup = cgroup_path;
+	if (cgroup != NULL)
+		for (int r = 0; r < PSI_MAX; r++) {
+			snprintf(path, sizeof(path), "%s/%s.pressure", cgroup,
+			         psi_resources[r]);
+			add_source(path, r, allowed, trigger);
+		}
+
+	if (n_sources == 0) {
+		nrm_log_error("No pressure stall information available!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	nrm_sensor_t *sensors[PSI_MAX][PSI_LINES][PSI_VALUES];
+	char name[64];
+	for (int r = 0; r < PSI_MAX; r++)
+		for (int l = 0; l < PSI_LINES; l++)
+			for (int v = 0; v < PSI_VALUES; v++) {
+				snprintf(name, sizeof(name),
+				         "nrm.sensor.psi.%s.%s-%s",
+				         psi_resources[r], psi_lines[l],
+				         psi_values[v]);
+				sensors[r][l][v] = nrm_sensor_create(name);
+				assert(nrm_client_add_sensor(
+				               client, sensors[r][l][v]) == 0);
+			}
+
+	struct pollfd pfds[2 * PSI_MAX];
+	for (size_t i = 0; i < n_sources; i++) {
+		pfds[i].fd = sources[i].trigger_fd;
+		pfds[i].events = POLLPRI;
+		psi_read(&sources[i]);
+		for (int l = 0; l < PSI_LINES; l++) {
+			sources[i].last[l] = sources[i].total[l];
+			sources[i].valid[l] = sources[i].have[l];
+		}
+	}
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_time_t current_time;
+	int timeout = 1000 / freq;
+
+	stop = 0;
+	while (!stop) {
+		// pfds with a negative fd are ignored, so sources without a
+		// trigger only cost us the heartbeat.
+		err = poll(pfds, n_sources, timeout);
+		if (err == -1) {
+			if (errno == EINTR)
+				continue;
+			nrm_log_error("poll failed: %s\n", strerror(errno));
+			break;
+		}
+		for (size_t i = 0; i < n_sources; i++)
+			if (pfds[i].revents & POLLERR) {
+				// the monitored cgroup went away
+				nrm_log_debug("trigger %zu disarmed\n", i);
+				pfds[i].fd = -1;
+			}
+
+		nrm_time_gettime(&current_time);
+
+		for (size_t i = 0; i < n_sources && !stop; i++) {
+			struct psi_source *s = &sources[i];
+
+			if (psi_read(s))
+				continue;
+			for (int l = 0; l < PSI_LINES && !stop; l++) {
+				double stall;
+
+				if (!s->have[l])
+					continue;
+				// microseconds of stall since the last report
+				stall = s->valid[l] && s->total[l] >= s->last[l]
+				                ? s->total[l] - s->last[l]
+				                : 0;
+				s->last[l] = s->total[l];
+				s->valid[l] = 1;
+
+				nrm_log_debug("%s %-6s %s avg10 %f stall %fus\n",
+				              s->scope == node ? "node"
+				                               : "allowed",
+				              psi_resources[s->resource],
+				              psi_lines[l], s->avg10[l], stall);
+				if (nrm_client_send_event(
+				            client, current_time,
+				            sensors[s->resource][l][PSI_AVG10],
+				            s->scope, s->avg10[l]) ||
+				    nrm_client_send_event(
+				            client, current_time,
+				            sensors[s->resource][l][PSI_STALL],
+				            s->scope, stall))
+					stop = 1;
+			}
+		}
+	}
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	for (size_t i = 0; i < n_sources; i++) {
+		close(sources[i].fd);
+		if (sources[i].trigger_fd != -1)
+			close(sources[i].trigger_fd);
+	}
+	if (node_added)
+		nrm_client_remove_scope(client, node);
+	nrm_scope_destroy(node);
+	if (allowed_added)
+		nrm_client_remove_scope(client, allowed);
+	nrm_scope_destroy(allowed);
+	nrm_log_debug("NRM scopes deleted.\n");
+
+	for (int r = 0; r < PSI_MAX; r++)
+		for (int l = 0; l < PSI_LINES; l++)
+			for (int v = 0; v < PSI_VALUES; v++)
+				nrm_sensor_destroy(&sensors[r][l][v]);
+	nrm_client_destroy(&client);
+
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+
+	exit(EXIT_SUCCESS);
+}
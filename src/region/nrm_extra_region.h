@@ -0,0 +1,46 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+#ifndef NRM_EXTRA_REGION_H
+#define NRM_EXTRA_REGION_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Region energy profiling.
+ *
+ * Code between nrm_extra_region_begin(name) and the matching
+ * nrm_extra_region_end() is accounted to name: number of calls, time, and
+ * package and DRAM energy read from the RAPL powercap counters. Regions nest,
+ * and are accounted inclusively. RAPL counters cover whole packages, so the
+ * energy of a region includes everything else running on the node at the
+ * same time.
+ *
+ * Each thread accounts its regions in a table of its own, without locking.
+ * A report of all regions, merged across threads, is written at exit to the
+ * file named by NRM_EXTRA_REGION_REPORT, or stderr.
+ *
+ * If NRM_EXTRA_REGION_STREAM is set, the cumulative energy of each region is
+ * also sent to NRM whenever the region ends, as sensor
+ * nrm.sensor.region.<name> on the allowed scope. This takes a lock on every
+ * end.
+ *
+ * Both calls return 0 on success, and an error if regions nest too deep or
+ * end without a begin.
+ */
+int nrm_extra_region_begin(const char *name);
+int nrm_extra_region_end(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,414 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: region.c
+ *
+ * Description: Region energy profiler. Reads the RAPL powercap counters at
+ *               the boundaries of user-defined regions and accumulates, per
+ *               thread, the calls, time and energy of each region.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+#include "nrm_extra_region.h"
+#include "powercap.h"
+
+#define REGION_MAX_DEPTH 32
+#define REGION_MAX_ZONES 16
+
+enum {
+	REGION_PACKAGE,
+	REGION_DRAM,
+	REGION_KINDS,
+};
+
+struct region_entry {
+	char *name;
+	uint64_t hash;
+	unsigned long calls;
+	int64_t time; /* ns */
+	uint64_t energy[REGION_KINDS]; /* uJ */
+};
+
+struct region_frame {
+	size_t entry;
+	struct timespec start;
+};
+
+/* Per-thread state. Entries are stored in a growing array, the open-addressed
+ * index on top of it only holds positions, so that frames can keep
+ * referring to an entry across a resize.
+ */
+struct region_table {
+	struct region_entry *entries;
+	size_t nentries, maxentries;
+	size_t *index; /* position + 1, 0 when empty */
+	size_t size;
+	struct region_frame stack[REGION_MAX_DEPTH];
+	uint64_t *snapshots; /* REGION_MAX_DEPTH * region_nzones */
+	int depth;
+	struct region_table *next;
+};
+
+static __thread struct region_table *region_self
+        __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t region_once = PTHREAD_ONCE_INIT;
+static nrm_extra_powercap_zone_t *region_zones;
+static size_t region_nzones;
+
+/* every table ever created, for the report */
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct region_table *region_tables;
+
+/* streaming to NRM, only when asked for */
+struct region_stream {
+	char *name;
+	nrm_sensor_t *sensor;
+	double joules;
+	struct region_stream *next;
+};
+
+static int region_streaming;
+static nrm_client_t *region_client;
+static nrm_scope_t *region_scope;
+static int region_scope_added;
+static struct region_stream *region_streams;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+static void region_report(void);
+
+static void region_init(void)
+{
+	const char *root = getenv("NRM_EXTRA_POWERCAP_ROOT");
+
+	if (root == NULL)
+		root = NRM_EXTRA_POWERCAP_ROOT;
+	if (nrm_extra_powercap_zones(root, &region_zones, &region_nzones))
+		fprintf(stderr,
+		        "nrm-extra-region: no RAPL zones in %s, only timing regions\n",
+		        root);
+	// a package and its dram, for up to 8 sockets
+	while (region_nzones > REGION_MAX_ZONES)
+		close(region_zones[--region_nzones].fd);
+
+	if (getenv("NRM_EXTRA_REGION_STREAM") != NULL) {
+		nrm_init(NULL, NULL);
+		nrm_client_create(&region_client, upstream_uri, pub_port,
+		                  rpc_port);
+		if (region_client != NULL &&
+		    !nrm_extra_find_allowed_scope(region_client, "nrm.region",
+		                                  &region_scope,
+		                                  &region_scope_added))
+			region_streaming = 1;
+	}
+	atexit(region_report);
+}
+
+static uint64_t region_hash(const char *name)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 1099511628211ULL;
+	return h;
+}
+
+static struct region_table *region_table_create(void)
+{
+	struct region_table *t;
+
+	pthread_once(&region_once, region_init);
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return NULL;
+	t->size = 64;
+	t->index = calloc(t->size, sizeof(size_t));
+	t->snapshots = calloc(REGION_MAX_DEPTH * (region_nzones + 1),
+	                      sizeof(uint64_t));
+	if (t->index == NULL || t->snapshots == NULL) {
+		free(t->index);
+		free(t->snapshots);
+		free(t);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&region_lock);
+	t->next = region_tables;
+	region_tables = t;
+	pthread_mutex_unlock(&region_lock);
+	region_self = t;
+	return t;
+}
+
+static int region_table_grow(struct region_table *t)
+{
+	size_t size = 2 * t->size, *index;
+
+	index = calloc(size, sizeof(size_t));
+	if (index == NULL)
+		return -NRM_ENOMEM;
+	for (size_t i = 0; i < t->nentries; i++) {
+		size_t slot = t->entries[i].hash & (size - 1);
+		while (index[slot] != 0)
+			slot = (slot + 1) & (size - 1);
+		index[slot] = i + 1;
+	}
+	free(t->index);
+	t->index = index;
+	t->size = size;
+	return 0;
+}
+
+static ssize_t region_lookup(struct region_table *t, const char *name)
+{
+	uint64_t hash = region_hash(name);
+	size_t slot = hash & (t->size - 1);
+	struct region_entry *e;
+
+	for (; t->index[slot] != 0; slot = (slot + 1) & (t->size - 1)) {
+		e = &t->entries[t->index[slot] - 1];
+		if (e->hash == hash && !strcmp(e->name, name))
+			return t->index[slot] - 1;
+	}
+
+	// new region for this thread, keep the index at most half full
+	if (t->nentries == t->maxentries) {
+		size_t max = t->maxentries ? 2 * t->maxentries : 16;
+		e = realloc(t->entries, max * sizeof(*e));
+		if (e == NULL)
+			return -1;
+		t->entries = e;
+		t->maxentries = max;
+	}
+	e = &t->entries[t->nentries];
+	memset(e, 0, sizeof(*e));
+	e->name = strdup(name);
+	if (e->name == NULL)
+		return -1;
+	e->hash = hash;
+	t->index[slot] = ++t->nentries;
+	if (2 * t->nentries > t->size && region_table_grow(t))
+		return -1;
+	return t->nentries - 1;
+}
+
+static void region_read(uint64_t *snapshot)
+{
+	for (size_t z = 0; z < region_nzones; z++)
+		if (nrm_extra_powercap_read(&region_zones[z], &snapshot[z]))
+			snapshot[z] = 0;
+}
+
+static void region_stream(const char *name, double joules)
+{
+	struct region_stream *s;
+	nrm_time_t now;
+
+	pthread_mutex_lock(&region_lock);
+	for (s = region_streams; s != NULL; s = s->next)
+		if (!strcmp(s->name, name))
+			break;
+	if (s == NULL) {
+		char sensor[256];
+
+		s = calloc(1, sizeof(*s));
+		if (s == NULL)
+			goto out;
+		s->name = strdup(name);
+		snprintf(sensor, sizeof(sensor), "nrm.sensor.region.%s", name);
+		s->sensor = nrm_sensor_create(sensor);
+		if (s->name == NULL || s->sensor == NULL ||
+		    nrm_client_add_sensor(region_client, s->sensor)) {
+			free(s->name);
+			free(s);
+			goto out;
+		}
+		s->next = region_streams;
+		region_streams = s;
+	}
+	s->joules += joules;
+	nrm_time_gettime(&now);
+	nrm_client_send_event(region_client, now, s->sensor, region_scope,
+	                      s->joules);
+out:
+	pthread_mutex_unlock(&region_lock);
+}
+
+int nrm_extra_region_begin(const char *name)
+{
+	struct region_table *t = region_self;
+	struct region_frame *f;
+	ssize_t entry;
+
+	if (__builtin_expect(t == NULL, 0)) {
+		t = region_table_create();
+		if (t == NULL)
+			return -NRM_ENOMEM;
+	}
+	if (t->depth == REGION_MAX_DEPTH)
+		return -NRM_EINVAL;
+	entry = region_lookup(t, name);
+	if (entry < 0)
+		return -NRM_ENOMEM;
+
+	f = &t->stack[t->depth];
+	f->entry = entry;
+	region_read(&t->snapshots[t->depth * region_nzones]);
+	clock_gettime(CLOCK_MONOTONIC, &f->start);
+	t->depth++;
+	return 0;
+}
+
+int nrm_extra_region_end(void)
+{
+	struct region_table *t = region_self;
+	uint64_t now[REGION_MAX_ZONES], *before, energy[REGION_KINDS] = {0};
+	struct region_entry *e;
+	struct region_frame *f;
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (t == NULL || t->depth == 0)
+		return -NRM_EINVAL;
+	t->depth--;
+	f = &t->stack[t->depth];
+	e = &t->entries[f->entry];
+	before = &t->snapshots[t->depth * region_nzones];
+
+	for (size_t z = 0; z < region_nzones; z++) {
+		const nrm_extra_powercap_zone_t *zone = &region_zones[z];
+
+		if (nrm_extra_powercap_read(zone, &now[z]) || before[z] == 0)
+			continue;
+		energy[zone->dram ? REGION_DRAM : REGION_PACKAGE] +=
+		        nrm_extra_powercap_delta(zone, before[z], now[z]);
+	}
+	e->calls++;
+	e->time += (end.tv_sec - f->start.tv_sec) * 1000000000LL +
+	           (end.tv_nsec - f->start.tv_nsec);
+	e->energy[REGION_PACKAGE] += energy[REGION_PACKAGE];
+	e->energy[REGION_DRAM] += energy[REGION_DRAM];
+
+	if (region_streaming)
+		region_stream(e->name, (energy[REGION_PACKAGE] +
+		                        energy[REGION_DRAM]) /
+		                               1e6);
+	return 0;
+}
+
+static int region_cmp(const void *a, const void *b)
+{
+	const struct region_entry *x = a, *y = b;
+	uint64_t ex = x->energy[REGION_PACKAGE] + x->energy[REGION_DRAM];
+	uint64_t ey = y->energy[REGION_PACKAGE] + y->energy[REGION_DRAM];
+
+	if (ex != ey)
+		return ex < ey ? 1 : -1;
+	return x->time < y->time ? 1 : x->time > y->time ? -1 : 0;
+}
+
+/* Merge the tables of all threads by name, and print one line per region,
+ * most energy-hungry first. Threads still running at exit may be caught in
+ * the middle of an update; the report is meant for the end of the program.
+ */
+static void region_report(void)
+{
+	struct region_entry *merged = NULL, *tmp;
+	size_t n = 0, max = 0;
+	struct region_table *t;
+	const char *path;
+	FILE *out = stderr;
+
+	pthread_mutex_lock(&region_lock);
+	for (t = region_tables; t != NULL; t = t->next)
+		for (size_t i = 0; i < t->nentries; i++) {
+			struct region_entry *e = &t->entries[i];
+			size_t j;
+
+			for (j = 0; j < n; j++)
+				if (!strcmp(merged[j].name, e->name))
+					break;
+			if (j == n) {
+				if (n == max) {
+					max = max ? 2 * max : 16;
+					tmp = realloc(merged,
+					              max * sizeof(*merged));
+					if (tmp == NULL)
+						goto out;
+					merged = tmp;
+				}
+				merged[n] = *e;
+				merged[n].calls = 0;
+				merged[n].time = 0;
+				memset(merged[n].energy, 0,
+				       sizeof(merged[n].energy));
+				n++;
+			}
+			merged[j].calls += e->calls;
+			merged[j].time += e->time;
+			merged[j].energy[REGION_PACKAGE] +=
+			        e->energy[REGION_PACKAGE];
+			merged[j].energy[REGION_DRAM] += e->energy[REGION_DRAM];
+		}
+	if (n == 0)
+		goto out;
+	qsort(merged, n, sizeof(*merged), region_cmp);
+
+	path = getenv("NRM_EXTRA_REGION_REPORT");
+	if (path != NULL && (out = fopen(path, "w")) == NULL)
+		out = stderr;
+	fprintf(out, "%-32s %10s %12s %12s %12s %10s\n", "region", "calls",
+	        "time (s)", "package (J)", "dram (J)", "power (W)");
+	for (size_t i = 0; i < n; i++) {
+		double time = merged[i].time / 1e9;
+		double pkg = merged[i].energy[REGION_PACKAGE] / 1e6;
+		double dram = merged[i].energy[REGION_DRAM] / 1e6;
+
+		fprintf(out, "%-32s %10lu %12.6f %12.6f %12.6f %10.3f\n",
+		        merged[i].name, merged[i].calls, time, pkg, dram,
+		        time > 0.0 ? (pkg + dram) / time : 0.0);
+	}
+	if (out != stderr)
+		fclose(out);
+out:
+	pthread_mutex_unlock(&region_lock);
+	free(merged);
+
+	if (region_streaming) {
+		struct region_stream *s, *next;
+
+		for (s = region_streams; s != NULL; s = next) {
+			next = s->next;
+			nrm_sensor_destroy(&s->sensor);
+			free(s->name);
+			free(s);
+		}
+		if (region_scope_added)
+			nrm_client_remove_scope(region_client, region_scope);
+		nrm_scope_destroy(region_scope);
+		nrm_client_destroy(&region_client);
+		nrm_finalize();
+		region_streaming = 0;
+	}
+}
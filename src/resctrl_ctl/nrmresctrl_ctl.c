@@ -0,0 +1,428 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmresctrl_ctl.c
+ *
+ * Description: Exposes resctrl allocation (Intel CAT/MBA, AMD QoS) as NRM
+ *               actuators: one per control group, NUMA node and resource,
+ *               setting every L3 domain of the node at once.
+ *               L3 actuators take a cache bitmask, MB actuators a memory
+ *               bandwidth percentage (Intel MBA only, MB is not exposed when
+ *               the kernel uses bandwidth units instead). Both are written to
+ *               the schemata file of the group.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+#include "resctrl.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+static const char *resctrl_root = NRM_EXTRA_RESCTRL_ROOT;
+
+char *usage =
+        "usage: nrm-resctrl-ctl [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -g, --group <name>[:<cpus>]\n"
+        "                                    Control group to expose, created if missing. Can be repeated.\n"
+        "                                    Defaults to every existing control group. <cpus> ties the group\n"
+        "                                    to a cpu list (0-7,16-23) or to the cpus of scope numa.N.\n"
+        "            -R, --root <dir>        Root of the resctrl filesystem (default: " NRM_EXTRA_RESCTRL_ROOT
+        ")\n"
+        "            -h, --help              Displays this help message\n";
+
+#define MAX_DOMAINS 256
+
+static const char *ctl_resources[NRM_EXTRA_RESCTRL_MAX] = {"L3", "MB"};
+static const char *ctl_names[NRM_EXTRA_RESCTRL_MAX] = {"l3", "mb"};
+
+static nrm_extra_resctrl_alloc_t hw;
+static hwloc_topology_t topology;
+
+struct ctl_actuator {
+	nrm_actuator_t *actuator;
+	/* fd is the schemata of the group, shared by all its actuators */
+	nrm_extra_resctrl_schema_t schema;
+};
+
+static struct ctl_actuator *actuators;
+static size_t n_actuators;
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+/* every contiguous mask the hardware accepts, lowest ways first */
+static size_t l3_choices(double **choices)
+{
+	int nbits = 64 - __builtin_clzll(hw.cbm_mask);
+	size_t n = 0;
+
+	*choices = calloc(nbits * (nbits + 1) / 2, sizeof(double));
+	assert(*choices != NULL);
+	for (int len = 1; len <= nbits; len++) {
+		uint64_t ones = len == 64 ? ~0ULL : (1ULL << len) - 1;
+		for (int shift = 0; shift + len <= nbits; shift++)
+			if (nrm_extra_resctrl_cbm_valid(&hw, ones << shift))
+				(*choices)[n++] = ones << shift;
+	}
+	return n;
+}
+
+static size_t mb_choices(double **choices)
+{
+	size_t n = 0;
+
+	*choices = calloc(101, sizeof(double));
+	assert(*choices != NULL);
+	for (uint64_t v = hw.min_bandwidth; v <= 100; v += hw.bandwidth_gran)
+		(*choices)[n++] = v;
+	return n;
+}
+
+static void log_last_cmd_status(void)
+{
+	char path[PATH_MAX], buf[256];
+	ssize_t n;
+	int fd;
+
+	if (nrm_extra_resctrl_path(resctrl_root, "info", "last_cmd_status",
+	                           path, sizeof(path)))
+		return;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+		buf[n] = '\0';
+		nrm_log_error("resctrl: %s", buf);
+	}
+}
+
+static int ctl_apply(struct ctl_actuator *a, double value)
+{
+	int err;
+
+	// out of range doubles do not convert to uint64_t
+	if (value < 0 || value != floor(value) ||
+	    value > (a->schema.resource == NRM_EXTRA_RESCTRL_L3 ? hw.cbm_mask
+	                                                         : 100)) {
+		nrm_log_error("invalid %s value: %f\n",
+		              ctl_resources[a->schema.resource], value);
+		return -NRM_EINVAL;
+	}
+	err = nrm_extra_resctrl_schema_write(&hw, &a->schema, value);
+	if (err == -NRM_FAILURE)
+		log_last_cmd_status();
+	if (err)
+		return err;
+	nrm_actuator_set_value(a->actuator, a->schema.current);
+	return 0;
+}
+
+static int actuate(nrm_uuid_t *uuid, double value)
+{
+	for (size_t i = 0; i < n_actuators; i++)
+		if (!nrm_string_cmp(*uuid,
+		                    *nrm_actuator_uuid(actuators[i].actuator)))
+			return ctl_apply(&actuators[i], value);
+	nrm_log_error("actuation request for an unknown actuator\n");
+	return -NRM_EINVAL;
+}
+
+/* "numa.N" stands for the cpus of NUMA node N, the nrm.*.cpu.N scopes */
+static int group_cpus(const char *spec, char *buf, size_t bufsize)
+{
+	hwloc_obj_t numa;
+	char *end;
+	long n;
+
+	if (strncmp(spec, "numa.", strlen("numa."))) {
+		snprintf(buf, bufsize, "%s", spec);
+		return 0;
+	}
+	n = strtol(spec + strlen("numa."), &end, 10);
+	numa = hwloc_get_obj_by_type(topology, HWLOC_OBJ_NUMANODE, n);
+	if (*end != '\0' || n < 0 || numa == NULL)
+		return -NRM_EINVAL;
+	hwloc_bitmap_list_snprintf(buf, bufsize, numa->cpuset);
+	return 0;
+}
+
+static int add_group_actuators(const char *group, const char *cpus, int *fd)
+{
+	char path[PATH_MAX], name[PATH_MAX], list[4096];
+	unsigned int domains[MAX_DOMAINS];
+	uint64_t values[MAX_DOMAINS];
+	int numa[MAX_DOMAINS];
+	double *choices[NRM_EXTRA_RESCTRL_MAX];
+	size_t nchoices[NRM_EXTRA_RESCTRL_MAX], n;
+
+	if (nrm_extra_resctrl_path(resctrl_root, group, "", path,
+	                           sizeof(path)))
+		return -NRM_EINVAL;
+	if (access(path, F_OK) && mkdir(path, 0755)) {
+		nrm_log_error("cannot create group %s: %s\n", path,
+		              strerror(errno));
+		return -NRM_FAILURE;
+	}
+	if (cpus != NULL) {
+		if (group_cpus(cpus, list, sizeof(list))) {
+			nrm_log_error("invalid cpus %s\n", cpus);
+			return -NRM_EINVAL;
+		}
+		if (nrm_extra_resctrl_set_cpus(resctrl_root, group, list))
+			return -NRM_FAILURE;
+		nrm_log_debug("group %s on cpus %s\n",
+		              nrm_extra_resctrl_group_name(group), list);
+	}
+
+	if (nrm_extra_resctrl_path(resctrl_root, group, "schemata", path,
+	                           sizeof(path)))
+		return -NRM_EINVAL;
+	*fd = open(path, O_WRONLY);
+	if (*fd == -1) {
+		nrm_log_error("cannot open %s: %s\n", path, strerror(errno));
+		return -NRM_FAILURE;
+	}
+
+	nchoices[NRM_EXTRA_RESCTRL_L3] =
+	        hw.available[NRM_EXTRA_RESCTRL_L3]
+	                ? l3_choices(&choices[NRM_EXTRA_RESCTRL_L3])
+	                : 0;
+	nchoices[NRM_EXTRA_RESCTRL_MB] =
+	        hw.available[NRM_EXTRA_RESCTRL_MB]
+	                ? mb_choices(&choices[NRM_EXTRA_RESCTRL_MB])
+	                : 0;
+
+	for (int r = 0; r < NRM_EXTRA_RESCTRL_MAX; r++) {
+		if (!hw.available[r])
+			continue;
+		nrm_extra_resctrl_read_schemata(resctrl_root, group,
+		                                ctl_resources[r],
+		                                r == NRM_EXTRA_RESCTRL_L3 ? 16
+		                                                          : 10,
+		                                domains, values, MAX_DOMAINS,
+		                                &n);
+		for (size_t d = 0; d < n; d++)
+			numa[d] = nrm_extra_resctrl_domain_numa(topology,
+			                                        domains[d]);
+
+		// one actuator per NUMA node, over all the domains of the node,
+		// named like the nrm.resctrl.numa.N scopes of nrm-resctrl-mon
+		for (size_t d = 0; d < n; d++) {
+			nrm_extra_resctrl_schema_t *schema;
+			struct ctl_actuator *a;
+			size_t e;
+
+			for (e = 0; e < d && numa[e] != numa[d]; e++)
+				;
+			if (e < d)
+				continue;
+
+			actuators = realloc(actuators,
+			                    (n_actuators + 1) *
+			                            sizeof(struct ctl_actuator));
+			assert(actuators != NULL);
+			a = &actuators[n_actuators];
+			schema = &a->schema;
+			schema->fd = *fd;
+			schema->resource = r;
+			schema->domains = calloc(n, sizeof(unsigned int));
+			assert(schema->domains != NULL);
+			schema->ndomains = 0;
+			schema->current = values[d];
+			for (e = d; e < n; e++) {
+				if (numa[e] != numa[d])
+					continue;
+				schema->domains[schema->ndomains++] = domains[e];
+				if (values[e] != values[d])
+					schema->current =
+					        NRM_EXTRA_RESCTRL_UNKNOWN;
+			}
+
+			snprintf(name, sizeof(name),
+			         "nrm.actuator.resctrl.%s.%s.%d", ctl_names[r],
+			         nrm_extra_resctrl_group_name(group), numa[d]);
+			a->actuator = nrm_actuator_create(name);
+			nrm_actuator_set_choices(a->actuator, nchoices[r],
+			                         choices[r]);
+			nrm_actuator_set_value(a->actuator, values[d]);
+			assert(nrm_client_add_actuator(client, a->actuator) ==
+			       0);
+			nrm_log_debug("actuator %s over %zu domains, current "
+			              "value %" PRIu64 "\n",
+			              name, schema->ndomains, values[d]);
+			n_actuators++;
+		}
+		free(choices[r]);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	char **groups = NULL;
+	size_t ngroups = 0;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"group", required_argument, 0, 'g'},
+		        {"root", required_argument, 0, 'R'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhg:R:", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'g':
+			groups = realloc(groups, (ngroups + 1) * sizeof(char *));
+			assert(groups != NULL);
+			groups[ngroups++] = strdup(optarg);
+			break;
+		case 'R':
+			resctrl_root = optarg;
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.resctrl-ctl") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	if (nrm_extra_resctrl_alloc_info(resctrl_root, &hw)) {
+		nrm_log_error("No L3 or MB allocation support under %s\n",
+		              resctrl_root);
+		exit(EXIT_FAILURE);
+	}
+	nrm_log_debug("L3: %d (cbm_mask %" PRIx64 ", min_cbm_bits %" PRIu64
+	              "), MB: %d (min %" PRIu64 "%%, granularity %" PRIu64
+	              "%%)\n",
+	              hw.available[NRM_EXTRA_RESCTRL_L3], hw.cbm_mask,
+	              hw.min_cbm_bits, hw.available[NRM_EXTRA_RESCTRL_MB],
+	              hw.min_bandwidth, hw.bandwidth_gran);
+
+	if (ngroups == 0) {
+		err = nrm_extra_resctrl_ctrl_groups(resctrl_root, &groups,
+		                                    &ngroups);
+		assert(err == 0);
+	}
+
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	int *fds = calloc(ngroups, sizeof(int));
+	assert(fds != NULL);
+	for (size_t g = 0; g < ngroups; g++) {
+		char *cpus = strchr(groups[g], ':');
+
+		if (cpus != NULL)
+			*cpus++ = '\0';
+		fds[g] = -1;
+		err = add_group_actuators(groups[g], cpus, &fds[g]);
+		if (err) {
+			nrm_log_error("skipping group %s\n",
+			              nrm_extra_resctrl_group_name(groups[g]));
+			continue;
+		}
+	}
+
+	if (n_actuators == 0) {
+		nrm_log_error("No resctrl allocation to expose!\n");
+		exit(EXIT_FAILURE);
+	}
+	nrm_log_debug("%zu actuators over %zu groups.\n", n_actuators,
+	              ngroups);
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_client_set_actuate_listener(client, actuate);
+	nrm_client_start_actuate_listener(client);
+
+	stop = 0;
+	while (!stop)
+		pause();
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	for (size_t i = 0; i < n_actuators; i++) {
+		nrm_client_remove_actuator(client, actuators[i].actuator);
+		nrm_actuator_destroy(&actuators[i].actuator);
+		free(actuators[i].schema.domains);
+	}
+	for (size_t g = 0; g < ngroups; g++)
+		if (fds[g] != -1)
+			close(fds[g]);
+
+	nrm_client_destroy(&client);
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+
+	nrm_extra_resctrl_groups_free(groups, ngroups);
+	free(fds);
+	free(actuators);
+
+	exit(EXIT_SUCCESS);
+}
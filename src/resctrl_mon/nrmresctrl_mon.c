@@ -0,0 +1,387 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmresctrl_mon.c
+ *
+ * Description: Implements middleware between resctrl monitoring (Intel RDT,
+ *               AMD QoS) and the NRM downstream interface. Reports memory
+ *               bandwidth and LLC occupancy per monitoring group and NUMA
+ *               node, summed over the L3 domains of the node (several per
+ *               node on AMD, or Intel with sub-NUMA clustering).
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+#include "resctrl.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+static const char *resctrl_root = NRM_EXTRA_RESCTRL_ROOT;
+
+char *usage =
+        "usage: nrm-resctrl-mon [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -R, --root <dir>        Root of the resctrl filesystem (default: " NRM_EXTRA_RESCTRL_ROOT
+        ")\n"
+        "            -h, --help              Displays this help message\n";
+
+enum {
+	MON_MBM_TOTAL,
+	MON_MBM_LOCAL,
+	MON_LLC_OCCUPANCY,
+	MON_MAX,
+};
+
+static const char *mon_files[MON_MAX] = {
+        "mbm_total_bytes",
+        "mbm_local_bytes",
+        "llc_occupancy",
+};
+
+static const char *mon_names[MON_MAX] = {
+        "mbm-total",
+        "mbm-local",
+        "llc-occupancy",
+};
+
+struct mon_node {
+	int numa_id;
+	nrm_scope_t *scope;
+	int added;
+};
+
+/* one (sensor, node) pair: the sum of a counter over the node domains */
+struct mon_series {
+	nrm_sensor_t *sensor;
+	size_t node; /* index in the node array */
+	size_t nevents;
+	size_t nread;
+	double sum;
+};
+
+struct mon_event {
+	int fd;
+	int kind;
+	unsigned int domain;
+	size_t series; /* index in the series array */
+	uint64_t last;
+	int valid;
+};
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+static size_t get_node(struct mon_node **nodes, size_t *nnodes, int numa_id)
+{
+	int err;
+
+	for (size_t i = 0; i < *nnodes; i++)
+		if ((*nodes)[i].numa_id == numa_id)
+			return i;
+
+	*nodes = realloc(*nodes, (*nnodes + 1) * sizeof(struct mon_node));
+	assert(*nodes != NULL);
+	(*nodes)[*nnodes].numa_id = numa_id;
+	err = nrm_extra_create_numa_scope(client, "nrm.resctrl", numa_id,
+	                                  &(*nodes)[*nnodes].scope,
+	                                  &(*nodes)[*nnodes].added);
+	assert(err == 0);
+	return (*nnodes)++;
+}
+
+static size_t get_series(struct mon_series **series,
+                         size_t *nseries,
+                         nrm_sensor_t *sensor,
+                         size_t node)
+{
+	for (size_t i = 0; i < *nseries; i++)
+		if ((*series)[i].sensor == sensor && (*series)[i].node == node)
+			return i;
+
+	*series = realloc(*series, (*nseries + 1) * sizeof(struct mon_series));
+	assert(*series != NULL);
+	memset(&(*series)[*nseries], 0, sizeof(struct mon_series));
+	(*series)[*nseries].sensor = sensor;
+	(*series)[*nseries].node = node;
+	return (*nseries)++;
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	double freq = 1;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"frequency", required_argument, 0, 'f'},
+		        {"root", required_argument, 0, 'R'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhf:R:", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 'R':
+			resctrl_root = optarg;
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.resctrl-mon") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	hwloc_topology_t topology;
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	char **groups;
+	size_t ngroups;
+	err = nrm_extra_resctrl_mon_groups(resctrl_root, &groups, &ngroups);
+	if (err || ngroups == 0) {
+		nrm_log_error("No resctrl monitoring groups found under %s\n",
+		              resctrl_root);
+		exit(EXIT_FAILURE);
+	}
+
+	// Everything we read in the loop is opened once here: one descriptor
+	// per (group, domain, counter) triplet, re-read with pread.
+	struct mon_event *events = NULL;
+	struct mon_node *nodes = NULL;
+	struct mon_series *series = NULL;
+	nrm_sensor_t **sensors;
+	size_t n_events = 0, n_nodes = 0, n_series = 0, n_sensors = 0;
+	char path[PATH_MAX], name[PATH_MAX];
+
+	sensors = calloc(ngroups * MON_MAX, sizeof(nrm_sensor_t *));
+	assert(sensors != NULL);
+
+	for (size_t g = 0; g < ngroups; g++) {
+		unsigned int *ids;
+		size_t nids;
+		nrm_sensor_t *group_sensors[MON_MAX] = {NULL};
+
+		if (nrm_extra_resctrl_mon_domains(resctrl_root, groups[g], &ids,
+		                                  &nids))
+			continue;
+
+		for (size_t d = 0; d < nids; d++) {
+			size_t node = get_node(
+			        &nodes, &n_nodes,
+			        nrm_extra_resctrl_domain_numa(topology, ids[d]));
+
+			for (int k = 0; k < MON_MAX; k++) {
+				size_t si;
+				int fd;
+
+				if (nrm_extra_resctrl_mon_path(
+				            resctrl_root, groups[g], ids[d],
+				            mon_files[k], path, sizeof(path)))
+					continue;
+				fd = open(path, O_RDONLY);
+				if (fd == -1)
+					continue;
+
+				if (group_sensors[k] == NULL) {
+					snprintf(name, sizeof(name),
+					         "nrm.sensor.resctrl.%s.%s",
+					         mon_names[k],
+					         nrm_extra_resctrl_group_name(
+					                 groups[g]));
+					group_sensors[k] = nrm_sensor_create(name);
+					assert(nrm_client_add_sensor(
+					               client, group_sensors[k]) ==
+					       0);
+					sensors[n_sensors++] = group_sensors[k];
+				}
+
+				events = realloc(events, (n_events + 1) *
+				                                 sizeof(struct mon_event));
+				assert(events != NULL);
+				si = get_series(&series, &n_series,
+				                group_sensors[k], node);
+				series[si].nevents++;
+				events[n_events].fd = fd;
+				events[n_events].kind = k;
+				events[n_events].domain = ids[d];
+				events[n_events].series = si;
+				events[n_events].valid = 0;
+				nrm_log_debug("monitoring %s\n", path);
+				n_events++;
+			}
+		}
+		free(ids);
+	}
+
+	if (n_events == 0) {
+		nrm_log_error("No readable resctrl monitoring counters!\n");
+		exit(EXIT_FAILURE);
+	}
+	nrm_log_debug("%zu counters over %zu groups and %zu NUMA nodes.\n",
+	              n_events, ngroups, n_nodes);
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_time_t last_time, current_time;
+	int64_t elapsed_time;
+
+	// prime the byte counters so the first tick already yields a rate
+	for (size_t i = 0; i < n_events; i++)
+		events[i].valid = !nrm_extra_resctrl_read_u64(events[i].fd,
+		                                              &events[i].last);
+	nrm_time_gettime(&last_time);
+
+	stop = 0;
+	double sleeptime = 1 / freq;
+
+	while (!stop) {
+		/* sleep for a frequency */
+		struct timespec req, rem;
+		req.tv_sec = sleeptime;
+		req.tv_nsec = (sleeptime - req.tv_sec) * 1e9;
+
+		err = nanosleep(&req, &rem);
+		if (err == -1 && errno == EINTR)
+			continue;
+
+		nrm_time_gettime(&current_time);
+		elapsed_time = nrm_time_diff(&last_time, &current_time);
+
+		for (size_t i = 0; i < n_series; i++) {
+			series[i].sum = 0.0;
+			series[i].nread = 0;
+		}
+
+		for (size_t i = 0; i < n_events; i++) {
+			struct mon_event *e = &events[i];
+			uint64_t value;
+			double out;
+
+			if (nrm_extra_resctrl_read_u64(e->fd, &value)) {
+				e->valid = 0;
+				continue;
+			}
+
+			if (e->kind == MON_LLC_OCCUPANCY)
+				out = value;
+			else if (e->valid && value >= e->last)
+				// bytes/s
+				out = (value - e->last) / (elapsed_time / 1e9);
+			else {
+				// first valid read, or the counter was reset
+				e->last = value;
+				e->valid = 1;
+				continue;
+			}
+			e->last = value;
+			e->valid = 1;
+
+			nrm_log_debug("L3 domain %u %-16s %f\n", e->domain,
+			              mon_names[e->kind], out);
+			series[e->series].sum += out;
+			series[e->series].nread++;
+		}
+
+		// a sum missing a domain would read as a drop, skip it instead
+		for (size_t i = 0; i < n_series && !stop; i++) {
+			struct mon_series *ms = &series[i];
+
+			if (ms->nread != ms->nevents)
+				continue;
+			if (nrm_client_send_event(client, current_time,
+			                          ms->sensor,
+			                          nodes[ms->node].scope, ms->sum))
+				stop = 1;
+		}
+
+		last_time = current_time;
+	}
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	for (size_t i = 0; i < n_events; i++)
+		close(events[i].fd);
+	for (size_t i = 0; i < n_nodes; i++) {
+		if (nodes[i].added)
+			nrm_client_remove_scope(client, nodes[i].scope);
+		nrm_scope_destroy(nodes[i].scope);
+	}
+	nrm_log_debug("NRM scopes deleted.\n");
+
+	for (size_t i = 0; i < n_sensors; i++)
+		nrm_sensor_destroy(&sensors[i]);
+	nrm_client_destroy(&client);
+
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+	nrm_extra_resctrl_groups_free(groups, ngroups);
+	free(sensors);
+	free(events);
+	free(series);
+	free(nodes);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,498 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: nrmthermal.c
+ *
+ * Description: Implements middleware between the Linux thermal interfaces
+ *               (hwmon, thermal zones, thermal_throttle) and the NRM
+ *               downstream interface. Reports package temperature and
+ *               throttling counters on the same per-package CPU scopes as
+ *               nrm-power-papi, so that power drops can be told apart from
+ *               thermal throttling.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <hwloc.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "extra.h"
+
+static int log_level = NRM_LOG_ERROR;
+volatile sig_atomic_t stop;
+
+static nrm_client_t *client;
+
+static char *upstream_uri = "tcp://127.0.0.1";
+static int pub_port = 2345;
+static int rpc_port = 3456;
+
+static const char *sysfs_root = "/sys";
+
+char *usage =
+        "usage: nrm-thermal [options] \n"
+        "     options:\n"
+        "            -v, --verbose           Produce verbose output. Log messages will be displayed to stderr\n"
+        "            -f, --frequency <hz>    Sampling frequency\n"
+        "            -S, --sysfs <dir>       Root of the sysfs filesystem (default: /sys)\n"
+        "            -h, --help              Displays this help message\n";
+
+enum {
+	THERMAL_TEMPERATURE,
+	THERMAL_CORE_THROTTLE_COUNT,
+	THERMAL_CORE_THROTTLE_TIME,
+	THERMAL_PACKAGE_THROTTLE_COUNT,
+	THERMAL_PACKAGE_THROTTLE_TIME,
+	THERMAL_MAX,
+};
+
+static const char *thermal_names[THERMAL_MAX] = {
+        "temperature",
+        "core-throttle-count",
+        "core-throttle-time",
+        "package-throttle-count",
+        "package-throttle-time",
+};
+
+/* files under cpuN/thermal_throttle, NULL for the temperature */
+static const char *throttle_files[THERMAL_MAX] = {
+        NULL,
+        "core_throttle_count",
+        "core_throttle_total_time_ms",
+        "package_throttle_count",
+        "package_throttle_total_time_ms",
+};
+
+struct thermal_package {
+	unsigned int id; /* physical package id */
+	hwloc_obj_t obj;
+	nrm_scope_t *scope;
+	int added;
+	int has_temperature;
+};
+
+struct thermal_read {
+	int fd;
+	int kind;
+	size_t package;
+};
+
+static struct thermal_package *packages;
+static size_t n_packages;
+static struct thermal_read *reads;
+static size_t n_reads;
+
+// handler for interrupt?
+void interrupt(int signum)
+{
+	stop = 1;
+}
+
+static int find_package(unsigned int id)
+{
+	for (size_t i = 0; i < n_packages; i++)
+		if (packages[i].id == id)
+			return i;
+	return -1;
+}
+
+static int add_read(const char *path, int kind, size_t package)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -NRM_EINVAL;
+	reads = realloc(reads, (n_reads + 1) * sizeof(struct thermal_read));
+	assert(reads != NULL);
+	reads[n_reads].fd = fd;
+	reads[n_reads].kind = kind;
+	reads[n_reads].package = package;
+	n_reads++;
+	nrm_log_debug("package %u: %s from %s\n", packages[package].id,
+	              thermal_names[kind], path);
+	return 0;
+}
+
+static int read_line(const char *path, char *buf, size_t size)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -NRM_EINVAL;
+	if (fgets(buf, size, f) == NULL) {
+		fclose(f);
+		return -NRM_EINVAL;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+/* AMD drivers sit on a PCI device of each die, several per package on
+ * multi-die parts: find the package from the cpus local to that device.
+ */
+static int hwmon_package(const char *dir, const char *hwmon)
+{
+	char path[PATH_MAX], buf[4096];
+	unsigned long cpu;
+	char *end;
+
+	snprintf(path, sizeof(path), "%s/%s/device/local_cpulist", dir, hwmon);
+	if (read_line(path, buf, sizeof(buf)))
+		return -1;
+	cpu = strtoul(buf, &end, 10);
+	if (end == buf)
+		return -1;
+	snprintf(path, sizeof(path),
+	         "%s/devices/system/cpu/cpu%lu/topology/physical_package_id",
+	         sysfs_root, cpu);
+	if (read_line(path, buf, sizeof(buf)))
+		return -1;
+	return find_package(strtoul(buf, NULL, 10));
+}
+
+/* coretemp exposes one "Package id N" label per package, AMD drivers a
+ * Tctl/Tdie per die.
+ */
+static void discover_hwmon(void)
+{
+	char dir[PATH_MAX], path[PATH_MAX], buf[64];
+	struct dirent **entries;
+	int n;
+
+	snprintf(dir, sizeof(dir), "%s/class/hwmon", sysfs_root);
+	n = scandir(dir, &entries, NULL, versionsort);
+	if (n < 0)
+		return;
+	for (int i = 0; i < n; i++) {
+		const char *hwmon = entries[i]->d_name;
+		int amd, amd_package = -1;
+
+		if (strncmp(hwmon, "hwmon", strlen("hwmon")))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/name", dir, hwmon);
+		if (read_line(path, buf, sizeof(buf)))
+			continue;
+		amd = !strcmp(buf, "k10temp") || !strcmp(buf, "zenpower");
+		if (strcmp(buf, "coretemp") && !amd)
+			continue;
+		if (amd) {
+			amd_package = hwmon_package(dir, hwmon);
+			if (amd_package == -1) {
+				nrm_log_debug("%s: no package for %s\n", hwmon,
+				              buf);
+				continue;
+			}
+		}
+
+		for (int t = 1; t < 256; t++) {
+			int package = -1;
+
+			snprintf(path, sizeof(path), "%s/%s/temp%d_label", dir,
+			         hwmon, t);
+			if (read_line(path, buf, sizeof(buf)))
+				continue;
+			if (!strncmp(buf, "Package id ", strlen("Package id ")))
+				package = find_package(strtoul(
+				        buf + strlen("Package id "), NULL, 10));
+			else if (amd && (!strcmp(buf, "Tctl") ||
+			                 !strcmp(buf, "Tdie")))
+				package = amd_package;
+			if (package == -1 || packages[package].has_temperature)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s/temp%d_input", dir,
+			         hwmon, t);
+			if (!add_read(path, THERMAL_TEMPERATURE, package))
+				packages[package].has_temperature = 1;
+		}
+	}
+	for (int i = 0; i < n; i++)
+		free(entries[i]);
+	free(entries);
+}
+
+/* x86_pkg_temp zones are created one per package, in package order. They
+ * duplicate coretemp, so only use them for packages hwmon did not cover.
+ */
+static void discover_thermal_zones(void)
+{
+	char dir[PATH_MAX], path[PATH_MAX], buf[64];
+	struct dirent **entries;
+	size_t package = 0;
+	int n;
+
+	snprintf(dir, sizeof(dir), "%s/class/thermal", sysfs_root);
+	n = scandir(dir, &entries, NULL, versionsort);
+	if (n < 0)
+		return;
+	for (int i = 0; i < n && package < n_packages; i++) {
+		const char *zone = entries[i]->d_name;
+
+		if (strncmp(zone, "thermal_zone", strlen("thermal_zone")))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/type", dir, zone);
+		if (read_line(path, buf, sizeof(buf)) ||
+		    strcmp(buf, "x86_pkg_temp"))
+			continue;
+		if (!packages[package].has_temperature) {
+			snprintf(path, sizeof(path), "%s/%s/temp", dir, zone);
+			if (!add_read(path, THERMAL_TEMPERATURE, package))
+				packages[package].has_temperature = 1;
+		}
+		package++;
+	}
+	for (int i = 0; i < n; i++)
+		free(entries[i]);
+	free(entries);
+}
+
+/* throttle counters are per core (shared by its hyperthreads) and per
+ * package (replicated on all its cpus): read each from one cpu only.
+ */
+static void discover_throttle(hwloc_topology_t topology)
+{
+	char path[PATH_MAX];
+
+	for (size_t p = 0; p < n_packages; p++) {
+		hwloc_obj_t core = NULL;
+		int cpu;
+
+		while ((core = hwloc_get_next_obj_inside_cpuset_by_type(
+		                topology, packages[p].obj->cpuset,
+		                HWLOC_OBJ_CORE, core)) != NULL) {
+			cpu = hwloc_bitmap_first(core->cpuset);
+			for (int k = THERMAL_CORE_THROTTLE_COUNT;
+			     k <= THERMAL_CORE_THROTTLE_TIME; k++) {
+				snprintf(path, sizeof(path),
+				         "%s/devices/system/cpu/cpu%d/thermal_throttle/%s",
+				         sysfs_root, cpu, throttle_files[k]);
+				add_read(path, k, p);
+			}
+		}
+
+		cpu = hwloc_bitmap_first(packages[p].obj->cpuset);
+		for (int k = THERMAL_PACKAGE_THROTTLE_COUNT;
+		     k <= THERMAL_PACKAGE_THROTTLE_TIME; k++) {
+			snprintf(path, sizeof(path),
+			         "%s/devices/system/cpu/cpu%d/thermal_throttle/%s",
+			         sysfs_root, cpu, throttle_files[k]);
+			add_read(path, k, p);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int char_opt, err;
+	double freq = 1;
+
+	while (1) {
+		static struct option long_options[] = {
+		        {"verbose", no_argument, 0, 'v'},
+		        {"help", no_argument, 0, 'h'},
+		        {"frequency", required_argument, 0, 'f'},
+		        {"sysfs", required_argument, 0, 'S'},
+		        {0, 0, 0, 0}};
+
+		int option_index = 0;
+		char_opt = getopt_long(argc, argv, "vhf:S:", long_options,
+		                       &option_index);
+
+		if (char_opt == -1)
+			break;
+		switch (char_opt) {
+		case 0:
+			break;
+		case 'v':
+			log_level = NRM_LOG_DEBUG;
+			break;
+		case 'f':
+			freq = strtod(optarg, NULL);
+			break;
+		case 'S':
+			sysfs_root = optarg;
+			break;
+		case 'h':
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_SUCCESS);
+		case '?':
+		default:
+			fprintf(stderr, "Wrong option argument\n");
+			fprintf(stderr, "%s", usage);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.thermal") == 0);
+
+	nrm_log_setlevel(log_level);
+	nrm_log_debug("NRM logging initialized.\n");
+
+	nrm_client_create(&client, upstream_uri, pub_port, rpc_port);
+	nrm_log_debug("NRM client initialized.\n");
+	assert(client != NULL);
+
+	hwloc_topology_t topology;
+	assert(hwloc_topology_init(&topology) == 0);
+	assert(hwloc_topology_load(topology) == 0);
+
+	n_packages = hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_PACKAGE);
+	packages = calloc(n_packages, sizeof(struct thermal_package));
+	assert(packages != NULL);
+	for (size_t p = 0; p < n_packages; p++) {
+		packages[p].obj =
+		        hwloc_get_obj_by_type(topology, HWLOC_OBJ_PACKAGE, p);
+		packages[p].id = packages[p].obj->os_index;
+	}
+
+	// discovery happens once, the loop only preads the descriptors
+	discover_hwmon();
+	discover_thermal_zones();
+	discover_throttle(topology);
+
+	if (n_reads == 0) {
+		nrm_log_error("No thermal sensors or throttle counters found!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// one sensor per kind of reading, only for the kinds we found
+	nrm_sensor_t *sensors[THERMAL_MAX] = {NULL};
+	char name[64];
+	for (size_t i = 0; i < n_reads; i++) {
+		int k = reads[i].kind;
+		if (sensors[k] != NULL)
+			continue;
+		snprintf(name, sizeof(name), "nrm.sensor.thermal.%s",
+		         thermal_names[k]);
+		sensors[k] = nrm_sensor_create(name);
+		assert(nrm_client_add_sensor(client, sensors[k]) == 0);
+	}
+
+	// same package to scope mapping as nrm-power-papi, which names its
+	// scopes after the RAPL package id.
+	for (size_t p = 0; p < n_packages; p++) {
+		err = nrm_extra_create_cpu_scope(client, topology, "nrm.thermal",
+		                                 packages[p].id,
+		                                 &packages[p].scope,
+		                                 &packages[p].added);
+		if (err) {
+			nrm_log_error("no NUMA node %u for package %u, skipping\n",
+			              packages[p].id, packages[p].id);
+			packages[p].scope = NULL;
+		}
+	}
+	nrm_log_debug("%zu readings over %zu packages.\n", n_reads,
+	              n_packages);
+
+	double(*values)[THERMAL_MAX];
+	int(*have)[THERMAL_MAX];
+	values = calloc(n_packages, sizeof(*values));
+	have = calloc(n_packages, sizeof(*have));
+	assert(values != NULL && have != NULL);
+
+	// register callback handler for interrupt
+	signal(SIGINT, interrupt);
+
+	nrm_time_t current_time;
+
+	stop = 0;
+	double sleeptime = 1 / freq;
+
+	while (!stop) {
+		/* sleep for a frequency */
+		struct timespec req, rem;
+		req.tv_sec = sleeptime;
+		req.tv_nsec = (sleeptime - req.tv_sec) * 1e9;
+
+		err = nanosleep(&req, &rem);
+		if (err == -1 && errno == EINTR)
+			continue;
+
+		nrm_time_gettime(&current_time);
+		memset(have, 0, n_packages * sizeof(*have));
+
+		for (size_t i = 0; i < n_reads; i++) {
+			struct thermal_read *r = &reads[i];
+			long long value;
+			double v;
+
+			if (nrm_extra_pread_ll(r->fd, &value))
+				continue;
+
+			if (r->kind == THERMAL_TEMPERATURE) {
+				// millidegrees Celsius, keep the hottest
+				v = value / 1e3;
+				if (!have[r->package][r->kind] ||
+				    v > values[r->package][r->kind])
+					values[r->package][r->kind] = v;
+			} else {
+				if (!have[r->package][r->kind])
+					values[r->package][r->kind] = 0;
+				values[r->package][r->kind] += value;
+			}
+			have[r->package][r->kind] = 1;
+		}
+
+		for (size_t p = 0; p < n_packages && !stop; p++)
+			for (int k = 0; k < THERMAL_MAX; k++) {
+				if (!have[p][k] || packages[p].scope == NULL)
+					continue;
+				nrm_log_debug("package %u %-24s %f\n",
+				              packages[p].id, thermal_names[k],
+				              values[p][k]);
+				if (nrm_client_send_event(client, current_time,
+				                          sensors[k],
+				                          packages[p].scope,
+				                          values[p][k])) {
+					stop = 1;
+					break;
+				}
+			}
+	}
+
+	nrm_log_error("Interrupt caught; exiting\n");
+
+	for (size_t i = 0; i < n_reads; i++)
+		close(reads[i].fd);
+	for (size_t p = 0; p < n_packages; p++) {
+		if (packages[p].scope == NULL)
+			continue;
+		if (packages[p].added)
+			nrm_client_remove_scope(client, packages[p].scope);
+		nrm_scope_destroy(packages[p].scope);
+	}
+	nrm_log_debug("NRM scopes deleted.\n");
+
+	for (int k = 0; k < THERMAL_MAX; k++)
+		if (sensors[k] != NULL)
+			nrm_sensor_destroy(&sensors[k]);
+	nrm_client_destroy(&client);
+
+	nrm_finalize();
+	hwloc_topology_destroy(topology);
+	free(values);
+	free(have);
+	free(reads);
+	free(packages);
+
+	exit(EXIT_SUCCESS);
+}
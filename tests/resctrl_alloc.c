@@ -0,0 +1,136 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: resctrl_alloc.c
+ *
+ * Description: Checks resctrl schemata writes against a fake resctrl tree,
+ *               given as argument: invalid values are rejected, valid ones
+ *               written to every domain, and a value already applied is not
+ *               written again. Also ties a group to cpus.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "resctrl.h"
+
+static char schemata[PATH_MAX];
+
+/* what the last write left in a file, "" if nothing was written */
+static void check_written(int fd, const char *expected)
+{
+	char buf[256];
+	ssize_t n;
+
+	n = pread(fd, buf, sizeof(buf) - 1, 0);
+	assert(n >= 0);
+	buf[n] = '\0';
+	assert(!strcmp(buf, expected));
+	assert(ftruncate(fd, 0) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	nrm_extra_resctrl_alloc_t hw;
+	nrm_extra_resctrl_schema_t l3, mb;
+	unsigned int domains[4], one = 1, both[2] = {0, 1};
+	uint64_t values[4];
+	char path[PATH_MAX];
+	size_t n;
+	int fd;
+
+	assert(argc == 2);
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.test") == 0);
+	nrm_log_setlevel(NRM_LOG_DEBUG);
+
+	assert(nrm_extra_resctrl_alloc_info(argv[1], &hw) == 0);
+	assert(hw.available[NRM_EXTRA_RESCTRL_L3]);
+	assert(hw.available[NRM_EXTRA_RESCTRL_MB]);
+	assert(hw.cbm_mask == 0x7ff && hw.min_cbm_bits == 1);
+	assert(hw.min_bandwidth == 10 && hw.bandwidth_gran == 10);
+
+	assert(nrm_extra_resctrl_read_schemata(argv[1], "", "L3", 16, domains,
+	                                       values, 4, &n) == 0);
+	assert(n == 2 && domains[1] == 1 && values[1] == 0x7ff);
+
+	assert(nrm_extra_resctrl_path(argv[1], "", "schemata", schemata,
+	                              sizeof(schemata)) == 0);
+	fd = open(schemata, O_RDWR);
+	assert(fd != -1);
+	assert(ftruncate(fd, 0) == 0);
+
+	l3 = (nrm_extra_resctrl_schema_t){fd, NRM_EXTRA_RESCTRL_L3, &one, 1,
+	                                  0x7ff};
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0) == -NRM_EINVAL);
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0x5) == -NRM_EINVAL);
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0x800) == -NRM_EINVAL);
+	check_written(fd, "");
+	assert(l3.current == 0x7ff);
+
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0xf0) == 0);
+	check_written(fd, "L3:1=f0\n");
+	assert(l3.current == 0xf0);
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0xf0) == 0);
+	check_written(fd, "");
+
+	mb = (nrm_extra_resctrl_schema_t){fd, NRM_EXTRA_RESCTRL_MB, both, 2,
+	                                  100};
+	assert(nrm_extra_resctrl_schema_write(&hw, &mb, 5) == -NRM_EINVAL);
+	assert(nrm_extra_resctrl_schema_write(&hw, &mb, 101) == -NRM_EINVAL);
+	assert(nrm_extra_resctrl_schema_write(&hw, &mb, 100) == 0);
+	check_written(fd, "");
+
+	// rounded up to the granularity, as the kernel would
+	assert(nrm_extra_resctrl_schema_write(&hw, &mb, 41) == 0);
+	check_written(fd, "MB:0=50;1=50\n");
+	assert(mb.current == 50);
+	assert(nrm_extra_resctrl_schema_write(&hw, &mb, 45) == 0);
+	check_written(fd, "");
+
+	// domains that disagree are always written
+	l3 = (nrm_extra_resctrl_schema_t){fd, NRM_EXTRA_RESCTRL_L3, both, 2,
+	                                  NRM_EXTRA_RESCTRL_UNKNOWN};
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0xff) == 0);
+	check_written(fd, "L3:0=ff;1=ff\n");
+	assert(nrm_extra_resctrl_schema_write(&hw, &l3, 0xff) == 0);
+	check_written(fd, "");
+	close(fd);
+
+	assert(nrm_extra_resctrl_set_cpus(argv[1], "grp", "0-3,8") == 0);
+	assert(nrm_extra_resctrl_path(argv[1], "grp", "cpus_list", path,
+	                              sizeof(path)) == 0);
+	fd = open(path, O_RDWR);
+	assert(fd != -1);
+	check_written(fd, "0-3,8\n");
+	close(fd);
+	assert(nrm_extra_resctrl_set_cpus(argv[1], "nope", "0") ==
+	       -NRM_FAILURE);
+
+	fd = open(schemata, O_RDWR);
+	assert(fd != -1);
+
+	// MB values above 100 are bandwidth units, not percentages
+	assert(pwrite(fd, "MB:0=2048;1=2048\n", 17, 0) == 17);
+	assert(nrm_extra_resctrl_alloc_info(argv[1], &hw) == 0);
+	assert(hw.available[NRM_EXTRA_RESCTRL_L3]);
+	assert(!hw.available[NRM_EXTRA_RESCTRL_MB]);
+
+	close(fd);
+	nrm_finalize();
+	return 0;
+}
@@ -0,0 +1,8 @@
+#!/bin/sh
+# The test writes to the schemata, run it on a scratch copy of the fake tree.
+set -e
+root=$(mktemp -d)
+trap 'rm -rf "$root"' EXIT
+cp -R "$srcdir/fake-resctrl/." "$root"
+chmod -R u+w "$root"
+./resctrl_alloc "$root"
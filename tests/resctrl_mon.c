@@ -0,0 +1,94 @@
+/*******************************************************************************
+ * Copyright 2021 UChicago Argonne, LLC.
+ * (c.f. AUTHORS, LICENSE)
+ *
+ * This file is part of the nrm-extra project.
+ * For more info, see https://github.com/anlsys/nrm-extra
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *******************************************************************************/
+
+/* Filename: resctrl_mon.c
+ *
+ * Description: Checks discovery and reading of resctrl monitoring counters
+ *               on the fake resctrl tree: groups, mon_L3_XX domains, and
+ *               counters the kernel cannot read.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <nrm.h>
+
+#include "resctrl.h"
+
+static char root[PATH_MAX];
+
+static int read_counter(const char *group,
+                        unsigned int domain,
+                        const char *counter,
+                        uint64_t *value)
+{
+	char path[PATH_MAX];
+	int fd, err;
+
+	assert(nrm_extra_resctrl_mon_path(root, group, domain, counter, path,
+	                                  sizeof(path)) == 0);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -NRM_EINVAL;
+	err = nrm_extra_resctrl_read_u64(fd, value);
+	close(fd);
+	return err;
+}
+
+int main(void)
+{
+	const char *srcdir = getenv("srcdir");
+	unsigned int *domains;
+	size_t ngroups, ndomains;
+	char **groups;
+	uint64_t value;
+
+	nrm_init(NULL, NULL);
+	assert(nrm_log_init(stderr, "nrm.extra.test") == 0);
+	snprintf(root, sizeof(root), "%s/fake-resctrl",
+	         srcdir != NULL ? srcdir : ".");
+
+	// the default group, then its monitoring groups
+	assert(nrm_extra_resctrl_mon_groups(root, &groups, &ngroups) == 0);
+	assert(ngroups == 2);
+	assert(!strcmp(groups[0], ""));
+	assert(!strcmp(groups[1], "mon_groups/job"));
+	assert(!strcmp(nrm_extra_resctrl_group_name(groups[0]), "default"));
+
+	for (size_t g = 0; g < ngroups; g++) {
+		assert(nrm_extra_resctrl_mon_domains(root, groups[g], &domains,
+		                                     &ndomains) == 0);
+		assert(ndomains == 2 && domains[0] == 0 && domains[1] == 1);
+		free(domains);
+	}
+
+	assert(read_counter("", 0, "mbm_total_bytes", &value) == 0);
+	assert(value == 1000000);
+	assert(read_counter("", 1, "llc_occupancy", &value) == 0);
+	assert(value == 2097152);
+	assert(read_counter("mon_groups/job", 0, "llc_occupancy", &value) ==
+	       0);
+	assert(value == 65536);
+
+	// the kernel reports "Unavailable" instead of a value
+	assert(read_counter("", 1, "mbm_local_bytes", &value) == -NRM_EINVAL);
+	// not every counter exists on every platform
+	assert(read_counter("mon_groups/job", 0, "mbm_total_bytes", &value) ==
+	       -NRM_EINVAL);
+
+	nrm_extra_resctrl_groups_free(groups, ngroups);
+	nrm_finalize();
+	return 0;
+}